@@ -10,3 +10,10 @@ int bfree(struct sb *sb, block_t block, unsigned blocks)
 	trace("<- %Lx, count %x\n", (L)block, blocks);
 	return 0;
 }
+
+int bfree_extents(struct sb *sb, struct seg map[], unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+		bfree(sb, map[i].block, map[i].count);
+	return 0;
+}
@@ -48,9 +48,27 @@ int main(int argc, char *argv[])
 		clear_bits(bitmap, 0, 7 * 8);
 		free(bitmap);
 	}
+	if (1) {
+		warn("---- test free run search ----");
+		u8 bits[32];
+		memset(bits, 0xff, sizeof(bits));
+		clear_bits(bits, 60, 9); /* straddles a word */
+		clear_bits(bits, 100, 3);
+		clear_bits(bits, 130, 120);
+		assert(find_zero_run(bits, 0, 256, 1) == 60);
+		assert(find_zero_run(bits, 61, 256, 1) == 61);
+		assert(find_zero_run(bits, 0, 256, 9) == 60);
+		assert(find_zero_run(bits, 0, 256, 10) == 130);
+		assert(find_zero_run(bits, 0, 66, 9) == -1);
+		assert(find_zero_run(bits, 101, 256, 2) == 101);
+		assert(find_zero_run(bits, 0, 256, 120) == 130);
+		assert(find_zero_run(bits, 0, 249, 120) == -1);
+		assert(find_zero_run(bits, 250, 256, 1) == -1);
+	}
 	struct dev *dev = &(struct dev){ .bits = 3 };
 	struct sb *sb = &(struct sb){ INIT_SB(dev), .super = { .volblocks = to_be_u64(150) }, };
 	struct inode *bitmap = rapid_open_inode(sb, NULL, 0);
+	sb->volblocks = from_be_u64(sb->super.volblocks);
 	sb->freeblocks = from_be_u64(sb->super.volblocks);
 	sb->nextalloc = from_be_u64(sb->super.volblocks); // this should wrap around to zero
 	sb->bitmap = bitmap;
@@ -88,5 +106,69 @@ int main(int argc, char *argv[])
 	bfree(sb, 0x7e, 1);
 	bfree(sb, 0x80, 1);
 	bitmap_dump(bitmap, 0, from_be_u64(sb->super.volblocks));
+
+	/* summary knows no bitmap block has 60 free in a row */
+	assert(balloc(sb, 60, &block) == -ENOSPC);
+	assert(sb->bsum->run[sb->bsum->leaves + 1] == 57);
+	assert(sb->bsum->free[2] == 20);
+	assert(bsum_next(sb->bsum, 0, 57) == 1);
+	assert(bsum_next(sb->bsum, 2, 57) == -1);
+	assert(!balloc(sb, 55, &block) && block == 0x40);
+	assert(sb->bsum->run[sb->bsum->leaves + 1] == 2);
+	assert(bsum_next(sb->bsum, 0, 52) == 0);
+	assert(bsum_next(sb->bsum, 1, 52) == -1);
+
+	/* four allocation groups of eight bitmap blocks */
+	struct sb *big = &(struct sb){ INIT_SB(dev), .volblocks = 2048, .freeblocks = 2048 };
+	big->bitmap = rapid_open_inode(big, NULL, 0);
+	for (int block = 0; block < 32; block++) {
+		struct buffer_head *buffer = blockget(big->bitmap->map, block);
+		memset(bufdata(buffer), 0, blocksize);
+		set_buffer_clean(buffer);
+	}
+	assert(!balloc_goal(big, 600, 1, &block) && block == 600);
+	assert(big->bsum->groups == 4 && big->bsum->group[1].goal == 601);
+	assert(group_goal(big, 6) == 1024 && group_goal(big, 5) == 601);
+	for (int i = 0; i < 7; i++)
+		assert(!balloc_goal(big, 512, 64, &block) && block == 512 + 64 * (i + (i > 0)));
+	assert(!balloc_goal(big, 512, 63, &block) && block == 1024);
+	assert(big->bsum->group[2].goal == 1087);
+	assert(!balloc_goal(big, 512, 39, &block) && block == 601);
+	assert(!balloc_goal(big, 512, 24, &block) && block == 576);
+	assert(!balloc_goal(big, 700, 1, &block) && block == 1087);
+	assert(big->freeblocks == 2048 - 1 - 7 * 64 - 63 - 39 - 24 - 1);
+
+	/* a request no single free run can hold comes back in pieces */
+	struct sb *frag = &(struct sb){ INIT_SB(dev), .volblocks = 512, .freeblocks = 512 };
+	frag->bitmap = rapid_open_inode(frag, NULL, 0);
+	for (int block = 0; block < 8; block++) {
+		struct buffer_head *buffer = blockget(frag->bitmap->map, block);
+		memset(bufdata(buffer), 0, blocksize);
+		set_buffer_clean(buffer);
+	}
+	for (int i = 0; i < 64; i++)
+		assert(!balloc_goal(frag, 0, 8, &block) && block == 8 * i);
+	for (int i = 1; i < 64; i += 2)
+		bfree(frag, 8 * i, 8);
+	struct seg map[4];
+	assert(balloc_extents(frag, 0, 30, map, 3) == -ENOSPC);
+	assert(frag->freeblocks == 256);
+	assert(balloc_extents(frag, 0, 30, map, 4) == 4);
+	assert(map[0].block == 8 && map[1].block == 24 && map[2].block == 40);
+	assert(map[3].block == 56 && map[3].count == 6);
+	assert(frag->freeblocks == 226);
+
+	/* batched frees are sorted and merged, across bitmap blocks too */
+	struct seg frees[] = { { 16, 8 }, { 56, 6 }, { 0, 8 }, { 64, 8 }, { 8, 8 } };
+	assert(!bfree_extents(frag, frees, ARRAY_SIZE(frees)));
+	assert(frag->freeblocks == 264);
+	assert(frag->bsum->run[frag->bsum->leaves] == 24);
+	assert(frag->bsum->run[frag->bsum->leaves + 1] == 16);
+	struct seg again[] = { { 32, 8 }, { 0, 1 } };
+	assert(bfree_extents(frag, again, ARRAY_SIZE(again)) == -1);
+	assert(frag->freeblocks == 272);
+	assert(count_range(frag->bitmap, 0, 512) == 512 - 272);
+	assert(count_range(frag->bitmap, 64, 64) == 64 - frag->bsum->free[1]);
+	assert(count_range(frag->bitmap, 24, 16) == 8);
 	exit(0);
 }
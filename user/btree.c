@@ -138,6 +138,21 @@ int uleaf_insert(struct btree *btree, struct uleaf *leaf, unsigned key, unsigned
 	return 0;
 }
 
+struct scan_check { tuxkey_t next; unsigned keys, leaves; };
+
+static int scan_check(struct btree *btree, vleaf *leaf, tuxkey_t key, tuxkey_t limit, void *data)
+{
+	struct scan_check *check = data;
+	struct uleaf *uleaf = leaf;
+	assert(key == check->next && key < limit);
+	for (unsigned i = 0; i < uleaf->count; i++)
+		if (uleaf->entries[i].key >= key && uleaf->entries[i].key < limit)
+			check->keys++;
+	check->next = limit;
+	check->leaves++;
+	return 0;
+}
+
 static void tree_expand_test(struct cursor *cursor, tuxkey_t key)
 {
 	struct btree *btree = cursor->btree;
@@ -162,7 +177,7 @@ int main(int argc, char *argv[])
 	struct sb *sb = &(struct sb){ INIT_SB(dev), };
 	sb->volmap = rapid_open_inode(sb, NULL, 0);
 	init_buffers(dev, 1 << 20, 0);
-	sb->entries_per_node = (sb->blocksize - offsetof(struct bnode, entries)) / sizeof(struct index_entry);
+	sb->entries_per_node = bnode_fanout(sb->blocksize);
 	printf("entries_per_node = %i\n", sb->entries_per_node);
 	struct btree btree = { };
 	assert(!new_btree(&btree, sb, &ops));
@@ -182,7 +197,47 @@ int main(int argc, char *argv[])
 	for (int key = 0; key < until_new_depth; key++)
 		tree_expand_test(cursor, key);
 	show_tree_range(&btree, 0, -1);
-	tree_chop(&btree, &(struct delete_info){ .key = 0 }, 0);
+
+	/* reprobes from a held path find the same paths as fresh probes */
+	struct cursor *held = alloc_cursor(&btree, 0);
+	for (int i = 0, key = 0; i < 3 * until_new_depth; i++) {
+		struct cursor *fresh = alloc_cursor(&btree, 0);
+		key = i < until_new_depth ? i : (key * 7 + 3) % until_new_depth;
+		if (i == 2 * until_new_depth)
+			btree.gen++;
+		assert(!reprobe(&btree, key, held));
+		assert(!probe(&btree, key, fresh));
+		assert(held->len == fresh->len);
+		for (int level = 0; level < held->len; level++) {
+			assert(held->path[level].buffer == fresh->path[level].buffer);
+			assert(held->path[level].next == fresh->path[level].next);
+		}
+		release_cursor(fresh);
+		free_cursor(fresh);
+	}
+	release_cursor(held);
+	free_cursor(held);
+
+	/* range scans cover exactly the requested keys, leaf ranges abutting */
+	for (tuxkey_t start = 0; start < until_new_depth; start += 7) {
+		tuxkey_t end = start + 3 * btree.entries_per_leaf;
+		struct scan_check check = { .next = start };
+		assert(!btree_scan(&btree, start, end, scan_check, &check));
+		assert(check.next >= end && check.leaves);
+		assert(check.keys >= (end < until_new_depth ? end : until_new_depth) - start);
+	}
+	struct scan_check whole = { };
+	assert(!btree_scan(&btree, 0, -1, scan_check, &whole));
+	assert(whole.keys == until_new_depth && whole.next == (tuxkey_t)-1);
+
+	/* a chop past its deadline stops after each leaf and resumes there */
+	struct delete_info info = { .key = 0 };
+	int slices = 0, suspended;
+	while ((suspended = tree_chop(&btree, &info, millitime() - 1)) == 1)
+		slices++;
+	assert(!suspended && slices > 1);
+	struct scan_check empty = { };
+	assert(!btree_scan(&btree, 0, -1, scan_check, &empty) && !empty.keys);
 
 	for (int key = until_new_depth * 100; key >= 0; key -= 100)
 		tree_expand_test(cursor, key);
@@ -216,5 +271,21 @@ int main(int argc, char *argv[])
 	free_cursor(cursor);
 	free_cursor(cursor2);
 	tree_chop(&btree, &(struct delete_info){ .key = 0 }, 0);
+
+	/* binary search finds what a linear scan would */
+	struct bnode *node = malloc(sizeof(*node) + 100 * sizeof(struct index_entry));
+	for (int count = 1; count <= 100; count++) {
+		node->count = to_be_u32(count);
+		for (int i = 0; i < count; i++)
+			set_index_key(node->entries + i, 3 * i);
+		for (tuxkey_t key = 0; key < 3 * count + 2; key++) {
+			struct index_entry *next = node->entries, *top = next + count;
+			while (++next < top)
+				if (index_key(next) > key)
+					break;
+			assert(bnode_seek(node, key) == next);
+		}
+	}
+	free(node);
 	exit(0);
 }
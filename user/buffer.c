@@ -1,6 +1,10 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "diskio.h"
 #include "buffer.h"
 #include "trace.h"
@@ -34,6 +38,10 @@ typedef long long L; /* widen to suppress printf warnings on 64 bit systems */
 
 struct list_head buffers[BUFFER_STATES], lru_buffers;
 static unsigned max_buffers = 10000, max_evict = 1000, buffer_count;
+static unsigned max_flush = 1 << 20; /* largest coalesced write in bytes */
+static unsigned min_readahead = 4, max_readahead = 256; /* in blocks */
+static unsigned dirty_count, dirty_background = 10, dirty_limit = 40; /* percent of max_buffers */
+static unsigned dirty_expire = 30; /* seconds */
 
 void show_buffer(struct buffer_head *buffer)
 {
@@ -100,8 +108,33 @@ void show_buffers_state(unsigned state)
 }
 
 
+/*
+ * A clean buffer may point into the volume mapping instead of its store.
+ * Any other state needs the store: dirtying copies the mapped data there
+ * first, while emptying or freeing the buffer just forgets the mapping.
+ */
+static void buffer_unmap(struct buffer_head *buffer, int copy)
+{
+	if (copy) {
+		memcpy(buffer->store, buffer->data, bufsize(buffer));
+		/* drop any private copy left by changes made before dirtying */
+		madvise(buffer->data, bufsize(buffer), MADV_DONTNEED);
+	}
+	buffer->data = buffer->store;
+}
+
 static inline void set_buffer_state_list(struct buffer_head *buffer, unsigned state, struct list_head *list)
 {
+	if (buffer->data != buffer->store && state != BUFFER_CLEAN)
+		buffer_unmap(buffer, state >= BUFFER_DIRTY);
+	if ((state >= BUFFER_DIRTY) != buffer_dirty(buffer)) {
+		if (buffer_dirty(buffer))
+			dirty_count--;
+		else {
+			dirty_count++;
+			buffer->dirtied = time(NULL);
+		}
+	}
 	list_move_tail(&buffer->link, list);
 	buffer->state = state;
 }
@@ -225,11 +258,13 @@ struct buffer_head *new_buffer(map_t *map)
 		.lru = LIST_HEAD_INIT(buffer->lru),
 	};
 	INIT_HLIST_NODE(&buffer->hashlink);
-	if ((err = -posix_memalign((void **)&(buffer->data), SECTOR_SIZE, 1 << map->dev->bits))) {
+	unsigned size = 1 << map->dev->bits; /* naturally aligned for O_DIRECT */
+	if ((err = -posix_memalign((void **)&(buffer->store), size < SECTOR_SIZE ? SECTOR_SIZE : size, size))) {
 		warn("Error: %s unable to expand buffer pool", strerror(err));
 		free(buffer);
 		return ERR_PTR(err);
 	}
+	buffer->data = buffer->store;
 have_buffer:
 	assert(!buffer->count);
 	assert(buffer->state == BUFFER_FREED);
@@ -286,8 +321,85 @@ struct buffer_head *blockget(map_t *map, block_t block)
 	return buffer;
 }
 
+/*
+ * Prefetch blocks not already cached.  This only hints the map prefetch
+ * method, which starts the io without waiting, so a later blockread of
+ * the same blocks finds them in the page cache.
+ */
+void blockprefetch(map_t *map, block_t block, unsigned count)
+{
+	if (!map->prefetch)
+		return;
+	while (count) {
+		struct buffer_head *buffer = peekblk(map, block);
+		if (buffer) {
+			brelse(buffer);
+			block++;
+			count--;
+			continue;
+		}
+		unsigned run = 1;
+		while (run < count && !(buffer = peekblk(map, block + run)))
+			run++;
+		if (buffer)
+			brelse(buffer);
+		map->prefetch(map, block, run);
+		block += run;
+		count -= run;
+	}
+}
+
+/*
+ * Adaptive readahead
+ *
+ * Every blockread is checked against the stream state of its map.  A read
+ * of the next block, or one that repeats the previous forward stride,
+ * continues the stream, anything else ends it.  Once a stream is seen, a
+ * window of reads is prefetched ahead of the reader, and each time the
+ * reader gets within half a window of the prefetched edge the next window
+ * goes out with double the size, up to max_readahead.
+ */
+static void map_readahead(map_t *map, block_t block)
+{
+	struct readahead *ra = &map->ra;
+	block_t last = ra->last;
+	if (block == last)
+		return;
+	ra->last = block;
+	if (block < last || (block - last != 1 && block - last != ra->stride)) {
+		ra->stride = block > last ? block - last : 0;
+		ra->window = 0;
+		return;
+	}
+	if (!ra->window || block - last != ra->stride) {
+		ra->stride = block - last;
+		ra->window = min_readahead;
+		ra->ahead = block + ra->stride;
+	}
+	if (ra->ahead <= block)
+		ra->ahead = block + ra->stride;
+	if ((ra->ahead - block) / ra->stride > ra->window / 2)
+		return;
+	buftrace("readahead %Lx, stride %u, window %u", (L)ra->ahead, ra->stride, ra->window);
+	if (ra->stride == 1)
+		blockprefetch(map, ra->ahead, ra->window);
+	else for (unsigned i = 0; i < ra->window; i++)
+		blockprefetch(map, ra->ahead + i * ra->stride, 1);
+	ra->ahead += (block_t)ra->window * ra->stride;
+	if ((ra->window *= 2) > max_readahead)
+		ra->window = max_readahead;
+}
+
+void set_readahead(unsigned min, unsigned max)
+{
+	min_readahead = min ? min : 1;
+	max_readahead = max < min_readahead ? min_readahead : max;
+}
+
 struct buffer_head *blockread(map_t *map, block_t block)
 {
+	if (map->prefetch)
+		map_readahead(map, block);
 	struct buffer_head *buffer = blockget(map, block);
 	if (buffer && buffer_empty(buffer)) {
 		buftrace("read buffer %Lx, state %i", (L)buffer->index, buffer->state);
@@ -300,6 +412,20 @@ struct buffer_head *blockread(map_t *map, block_t block)
 	return buffer;
 }
 
+blockio_t dev_blockio;
+
+static unsigned flushing; /* dirty state being written by flush_state, if any */
+static unsigned writing_ahead; /* inside a write ahead from blockdirty */
+
+/*
+ * A buffer dirty in an older delta must keep that delta's data until it is
+ * written, so redirtying it for a new delta normally forks it: a clone
+ * takes over the old data and state, and the buffer goes on with a copy.
+ * If the old delta is being flushed right now the fork is not needed, the
+ * buffer can just be written ahead of its turn by its map's io method.
+ * A method that allocates (filemap_extent_io) may redirty bitmap buffers
+ * and end up back here, those nested calls fork instead.
+ */
 int blockdirty(struct buffer_head *buffer, unsigned newdelta)
 {
 	unsigned oldstate = buffer->state;
@@ -308,18 +434,28 @@ int blockdirty(struct buffer_head *buffer, unsigned newdelta)
 	if (oldstate >= BUFFER_DIRTY) {
 		if (oldstate - BUFFER_DIRTY == newdelta)
 			return 0;
+		if (oldstate == flushing && !writing_ahead) {
+			trace_on("---- write ahead buffer %p ----", buffer);
+			writing_ahead = 1;
+			int err = buffer->map->io(buffer, 1);
+			writing_ahead = 0;
+			if (err)
+				return err;
+			goto dirty;
+		}
 		trace_on("---- fork buffer %p ----", buffer);
 		struct buffer_head *clone = new_buffer(buffer->map);
-		if (IS_ERR(buffer))
-			return PTR_ERR(buffer);
+		if (IS_ERR(clone))
+			return PTR_ERR(clone);
 		memcpy(bufdata(clone), bufdata(buffer), bufsize(buffer));
 		void *data = buffer->data;
-		buffer->data = clone->data;
-		clone->data = data;
+		buffer->data = buffer->store = clone->data;
+		clone->data = clone->store = data;
 		clone->index = buffer->index;
 		set_buffer_state(clone, oldstate);
 		brelse(clone);
 	}
+dirty:
 	set_buffer_state_list(buffer, BUFFER_DIRTY + newdelta, &buffer->map->dirty);
 	return 0;
 }
@@ -339,30 +475,208 @@ void evict_buffers(map_t *map)
 	}
 }
 
+/*
+ * Writeback goes out in batches sorted by map and block, so each map is
+ * written in ascending (elevator) order.  Maps with their own io method
+ * are written first, one buffer at a time, since the method may clean
+ * some neighbours of the buffer it was asked to write.  For maps doing
+ * plain device io the index is the physical block, so runs of adjacent
+ * dirty buffers are merged into vectored writes of at most max_flush
+ * bytes, all submitted together and reaped before the batch is released.
+ * The state of each buffer is noted when it is batched so a buffer
+ * redirtied into another delta meanwhile is left alone.
+ */
+#define FLUSH_BATCH 1024
+
+struct flush_entry { struct buffer_head *buffer; unsigned state; };
+
+struct flush_run {
+	struct diskreq req;
+	struct flush_entry *entry;
+	int *err;
+};
+
+struct flush_io {
+	struct flush_entry batch[FLUSH_BATCH];
+	struct iovec iov[FLUSH_BATCH];
+	struct flush_run run[FLUSH_BATCH];
+};
+
+static int flush_compare(const void *a, const void *b)
+{
+	struct buffer_head *x = ((struct flush_entry *)a)->buffer;
+	struct buffer_head *y = ((struct flush_entry *)b)->buffer;
+	if (x->map != y->map)
+		return x->map < y->map ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void flush_end_io(struct diskreq *req, int err)
+{
+	struct flush_run *run = container_of(req, struct flush_run, req);
+	if (err) {
+		warn("write %i buffers at %Lx failed (%s)", req->iovcnt, (L)run->entry->buffer->index, strerror(-err));
+		if (!*run->err)
+			*run->err = err;
+		return;
+	}
+	for (int i = 0; i < req->iovcnt; i++)
+		set_buffer_clean(run->entry[i].buffer);
+}
+
+static int flush_run(struct flush_run *run, struct flush_entry *entry, struct iovec *iov, unsigned count, int *err)
+{
+	struct dev *dev = entry->buffer->map->dev;
+	for (unsigned i = 0; i < count; i++)
+		iov[i] = (struct iovec){ .iov_base = bufdata(entry[i].buffer), .iov_len = bufsize(entry[i].buffer) };
+	buftrace("write %u buffers at %Lx", count, (L)entry->buffer->index);
+	*run = (struct flush_run){
+		.req = {
+			.fd = dev_metafd(dev), .write = 1,
+			.iov = iov, .iovcnt = count,
+			.offset = entry->buffer->index << dev->bits,
+			.end_io = flush_end_io },
+		.entry = entry, .err = err };
+	return disksubmit(&run->req);
+}
+
+unsigned set_flush_size(unsigned bytes)
+{
+	unsigned old = max_flush;
+	max_flush = bytes;
+	return old;
+}
+
 int flush_list(struct list_head *list)
 {
-	int err = 0;
-	while (!list_empty(list)) {
-		struct buffer_head *buffer = list_entry(list->next, struct buffer_head, link);
-		buftrace("write buffer %Lx", (L)buffer->index);
-		assert(buffer_dirty(buffer));
-		if ((err = buffer->map->io(buffer, 1)))
+	struct flush_io *io = malloc(sizeof(*io));
+	struct flush_entry *batch = io ? io->batch : NULL;
+	struct buffer_head *buffer;
+	int err = io ? 0 : -ENOMEM;
+	while (!err && !list_empty(list)) {
+		unsigned count = 0, runs = 0, i, j;
+		int ioerr = 0;
+		list_for_each_entry(buffer, list, link) {
+			assert(buffer_dirty(buffer));
+			get_bh(buffer);
+			batch[count++] = (struct flush_entry){ buffer, buffer->state };
+			if (count == FLUSH_BATCH)
+				break;
+		}
+		qsort(batch, count, sizeof(*batch), flush_compare);
+		for (i = 0; i < count; i++) {
+			buffer = batch[i].buffer;
+			if (buffer->map->io == dev_blockio || buffer->state != batch[i].state)
+				continue;
+			buftrace("write buffer %Lx", (L)buffer->index);
+			if ((err = buffer->map->io(buffer, 1)))
+				break;
+			if (buffer->state != BUFFER_CLEAN)
+				set_buffer_clean(buffer);
+			assert(buffer_clean(buffer));
+		}
+		for (i = 0; i < count && !err; i = j) {
+			buffer = batch[i].buffer;
+			j = i + 1;
+			if (buffer->map->io != dev_blockio || buffer->state != batch[i].state)
+				continue;
+			unsigned most = max_flush >> buffer->map->dev->bits;
+			if (most > IOV_MAX)
+				most = IOV_MAX;
+			while (j < count && j - i < most &&
+			       batch[j].buffer->map == buffer->map &&
+			       batch[j].buffer->index == batch[j - 1].buffer->index + 1 &&
+			       batch[j].buffer->state == batch[j].state)
+				j++;
+			err = flush_run(io->run + runs++, batch + i, io->iov + i, j - i, &ioerr);
+		}
+		if (runs) {
+			int ret = diskcomplete(1);
+			if (!err)
+				err = ret < 0 ? ret : ioerr;
+		}
+		while (count)
+			brelse(batch[--count].buffer);
+	}
+	free(io);
+	return err;
+}
+
+/*
+ * Writeback throttling
+ *
+ * There is no flusher thread, because neither the buffer cache nor the
+ * btree code above it is thread safe.  Instead writers call in here at
+ * points where they hold no locks.  Above the background threshold, or
+ * once the oldest dirty buffer of the map has passed the expire time, a
+ * batch of the oldest dirty buffers of the map is written out.  Above the
+ * hard limit the writer is held until the map is back under the
+ * background threshold.  This keeps new_buffer from running out of clean
+ * buffers to evict.
+ */
+#define WRITEBACK_BATCH 256
+
+int balance_dirty_buffers(map_t *map)
+{
+	unsigned background = max_buffers / 100 * dirty_background;
+	unsigned limit = max_buffers / 100 * dirty_limit;
+	time_t expire = time(NULL) - dirty_expire;
+	struct buffer_head *buffer;
+	if (list_empty(&map->dirty))
+		return 0;
+	buffer = list_entry(map->dirty.next, struct buffer_head, link);
+	if (dirty_count <= background && buffer->dirtied > expire)
+		return 0;
+
+	unsigned count = 0, batch = WRITEBACK_BATCH;
+	if (dirty_count > limit && dirty_count - background > batch)
+		batch = dirty_count - background;
+	LIST_HEAD(list);
+	while (!list_empty(&map->dirty) && count < batch) {
+		buffer = list_entry(map->dirty.next, struct buffer_head, link);
+		if (dirty_count - count <= background && buffer->dirtied > expire)
 			break;
-		if(buffer->state != BUFFER_CLEAN)
-			set_buffer_clean(buffer);
-		assert(buffer_clean(buffer));
+		list_move_tail(&buffer->link, &list);
+		count++;
 	}
+	buftrace("writeback %u of %u dirty buffers", count, dirty_count);
+	if (map->writeback)
+		map->writeback(map, count);
+	int err = flush_list(&list);
+	if (map->writeback)
+		map->writeback(map, 0);
+	while (!list_empty(&list)) /* put back what was not written, oldest first */
+		list_move(list.prev, &map->dirty);
 	return err;
 }
 
+void set_writeback(unsigned background, unsigned limit, unsigned expire)
+{
+	dirty_background = background;
+	dirty_limit = limit < background ? background : limit;
+	dirty_expire = expire;
+}
+
 int flush_buffers(map_t *map)
 {
-	return flush_list(&map->dirty);
+	if (!map->writeback || list_empty(&map->dirty))
+		return flush_list(&map->dirty);
+	struct buffer_head *buffer;
+	unsigned count = 0;
+	list_for_each_entry(buffer, &map->dirty, link)
+		count++;
+	map->writeback(map, count);
+	int err = flush_list(&map->dirty);
+	map->writeback(map, 0);
+	return err;
 }
 
 int flush_state(unsigned state)
 {
-	return flush_list(buffers + state);
+	flushing = state;
+	int err = flush_list(buffers + state);
+	flushing = 0;
+	return err;
 }
 
 static int debug_buffer;
@@ -376,7 +690,7 @@ static void free_buffer(struct buffer_head *buffer)
 		assert(!hlist_unhashed(&buffer->hashlink));
 	list_del(&buffer->lru);
 	list_del(&buffer->link);
-	free(buffer->data);
+	free(buffer->store);
 	free(buffer);
 }
 
@@ -449,13 +763,14 @@ int preallocate_buffers(unsigned bufsize)
 	if (!prealloc_heads)
 		goto buffers_allocation_failure;
 	buftrace("Pre-allocating data for buffers...");
-	if ((err = posix_memalign((void **)&data_pool, (1 << SECTOR_BITS), max_buffers*bufsize)))
+	if ((err = posix_memalign((void **)&data_pool, bufsize < SECTOR_SIZE ? SECTOR_SIZE : bufsize, max_buffers*bufsize)))
 		goto data_allocation_failure;
 
 	//memset(data_pool, 0xdd, max_buffers*bufsize); /* first time init to deadly data */
 	for(i = 0; i < max_buffers; i++) {
 		prealloc_heads[i] = (struct buffer_head){
 			.data = (data_pool + i*bufsize),
+			.store = (data_pool + i*bufsize),
 			.state = BUFFER_FREED,
 			.lru = LIST_HEAD_INIT(prealloc_heads[i].lru),
 		};
@@ -494,20 +809,81 @@ int dev_blockio(struct buffer_head *buffer, int write)
 	warn("read [%Lx]", (L)buffer->index);
 	struct dev *dev = buffer->map->dev;
 	assert(dev->bits >= 8 && dev->fd);
-	int err;
+	int err = 0;
 	if (write)
-		err = diskwrite(dev->fd, buffer->data, bufsize(buffer), buffer->index << dev->bits);
-	else
-		err = diskread(dev->fd, buffer->data, bufsize(buffer), buffer->index << dev->bits);
+		err = diskwrite(dev_metafd(dev), buffer->data, bufsize(buffer), buffer->index << dev->bits);
+	else if (!bufmap(buffer, buffer->index))
+		err = diskread(dev_metafd(dev), buffer->data, bufsize(buffer), buffer->index << dev->bits);
 	if (!err)
 		set_buffer_clean(buffer);
 	return err;
 }
 
+/*
+ * Zero copy reads: map the whole volume and let clean buffers point into
+ * the page cache instead of holding a copy.  The mapping is private, so
+ * code that changes a buffer before marking it dirty gets an anonymous
+ * copy of the page rather than writing the volume outside delta order.
+ * Blocks smaller than a page are not supported, since dropping that
+ * private copy on dirty affects the whole page.
+ */
+int dev_mmap(struct dev *dev)
+{
+	uint64_t size;
+	if (1 << dev->bits < sysconf(_SC_PAGESIZE) || dev->datafd)
+		return -EINVAL;
+	if (fdsize64(dev->fd, &size))
+		return -errno;
+	void *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, dev->fd, 0);
+	if (base == MAP_FAILED)
+		return -errno;
+	dev->base = base;
+	dev->size = size;
+	return 0;
+}
+
+/*
+ * Direct io: file data bypasses the page cache so each block is cached
+ * once, in our buffers, which are naturally aligned.  Metadata, which is
+ * smaller and hotter, stays buffered unless asked otherwise.  The
+ * superblock is always read and written through the buffered descriptor.
+ */
+int dev_direct(struct dev *dev, const char *name, int metadata)
+{
+	if (dev->bits < SECTOR_BITS || dev->base)
+		return -EINVAL;
+	int fd = diskopen(name, O_RDWR | O_DIRECT, 0);
+	if (fd < 0)
+		return fd;
+	dev->datafd = fd;
+	if (metadata)
+		dev->metafd = fd;
+	return 0;
+}
+
+/* Point an empty buffer at a block of the volume mapping, if possible */
+int bufmap(struct buffer_head *buffer, block_t block)
+{
+	struct dev *dev = buffer->map->dev;
+	loff_t offset = block << dev->bits;
+	assert(buffer->data == buffer->store);
+	if (!dev->base || offset + bufsize(buffer) > dev->size)
+		return 0;
+	buffer->data = dev->base + offset;
+	return 1;
+}
+
+static void dev_prefetch(map_t *map, block_t block, unsigned count)
+{
+	struct dev *dev = map->dev;
+	if (!dev->metafd)
+		diskprefetch(dev->fd, (size_t)count << dev->bits, block << dev->bits);
+}
+
 map_t *new_map(struct dev *dev, blockio_t *io)
 {
 	map_t *map = malloc(sizeof(*map)); // error???
-	*map = (map_t){ .dev = dev, .io = io ? io : dev_blockio };
+	*map = (map_t){ .dev = dev, .io = io ? io : dev_blockio, .prefetch = io ? NULL : dev_prefetch };
 	INIT_LIST_HEAD(&map->dirty);
 	for (int i = 0; i < BUFFER_BUCKETS; i++)
 		INIT_HLIST_HEAD(&map->hash[i]);
@@ -521,6 +897,30 @@ void free_map(map_t *map)
 }
 
 #ifdef build_buffer
+static unsigned prefetched;
+
+static void count_prefetch(map_t *map, block_t block, unsigned count)
+{
+	prefetched += count;
+}
+
+static void check_read(struct diskreq *req, int err)
+{
+	assert(!err && req->iov->iov_base == req->info);
+}
+
+/* Writing block 8 redirties block 9, which is in the delta being flushed */
+static int redirty_io(struct buffer_head *buffer, int write)
+{
+	if (write && buffer->index == 8) {
+		struct buffer_head *next = peekblk(buffer->map, 9);
+		void *data = next->data;
+		assert(!blockdirty(next, 1) && next->data == data);
+		brelse(next);
+	}
+	return dev_blockio(buffer, write);
+}
+
 int main(int argc, char *argv[])
 {
 	struct dev *dev = &(struct dev){ .bits = 12 };
@@ -534,6 +934,113 @@ int main(int argc, char *argv[])
 	printf("get %p\n", blockget(map, 2));
 	printf("get %p\n", blockget(map, 1));
 	show_dirty_buffers(map);
+	/* sorted, coalesced writeback */
+	FILE *file = tmpfile();
+	dev->fd = fileno(file);
+	block_t order[] = { 5, 0, 2, 6, 4 };
+	for (int i = 0; i < sizeof(order) / sizeof(*order); i++) {
+		struct buffer_head *buffer = blockget(map, order[i]);
+		memset(bufdata(buffer), 'a' + order[i], bufsize(buffer));
+		brelse_dirty(buffer);
+	}
+	memset(bufdata(blockget(map, 1)), 'b', 1 << dev->bits);
+	show_dirty_buffers(map);
+	assert(!flush_buffers(map));
+	show_dirty_buffers(map);
+	for (int i = 0; i < 7; i++) {
+		char c;
+		assert(!diskread(dev->fd, &c, 1, i << dev->bits));
+		assert(c == (i == 3 ? 0 : 'a' + i));
+	}
+	/* asynchronous reads complete in submission order */
+	char got[2];
+	struct diskreq req[2];
+	struct iovec iov[2];
+	for (int i = 0; i < 2; i++) {
+		iov[i] = (struct iovec){ got + i, 1 };
+		req[i] = (struct diskreq){ .fd = dev->fd, .iov = iov + i, .iovcnt = 1,
+			.offset = (4 + 2 * i) << dev->bits, .end_io = check_read, .info = got + i };
+		assert(!disksubmit(req + i));
+	}
+	assert(diskcomplete(1) == 2 && got[0] == 'e' && got[1] == 'g');
+	/* readahead on a sequential, then strided, then random stream */
+	assert(!ftruncate(dev->fd, 1000 << dev->bits));
+	map_t *map2 = new_map(dev, NULL);
+	map2->prefetch = count_prefetch;
+	for (int i = 0; i < 100; i++)
+		brelse(blockread(map2, i));
+	printf("sequential: prefetched %u, window %u\n", prefetched, map2->ra.window);
+	assert(prefetched >= 99 && map2->ra.window > 4);
+	prefetched = 0;
+	for (int i = 200; i < 800; i += 10)
+		brelse(blockread(map2, i));
+	printf("strided: prefetched %u, stride %u\n", prefetched, map2->ra.stride);
+	assert(prefetched && map2->ra.stride == 10);
+	prefetched = 0;
+	for (int i = 0; i < 20; i++)
+		brelse(blockread(map2, (i * 7919) % 997));
+	assert(!prefetched && !map2->ra.window);
+	/* zero copy reads, dirtying promotes to a private copy */
+	assert(!dev_mmap(dev));
+	map_t *map3 = new_map(dev, NULL);
+	struct buffer_head *buffer = blockread(map3, 5);
+	assert(buffer->data != buffer->store && *(char *)bufdata(buffer) == 'f');
+	mark_buffer_dirty(buffer);
+	assert(buffer->data == buffer->store && *(char *)bufdata(buffer) == 'f');
+	memset(bufdata(buffer), 'F', bufsize(buffer));
+	brelse(buffer);
+	assert(!flush_buffers(map3));
+	evict_buffers(map3);
+	buffer = blockread(map3, 5);
+	assert(buffer->data != buffer->store && *(char *)bufdata(buffer) == 'F');
+	brelse(buffer);
+	/* writers are held to the dirty limit */
+	set_writeback(1, 2, 30);
+	for (int i = 0; i < 500; i++) {
+		assert(!balance_dirty_buffers(map3));
+		brelse_dirty(blockget(map3, i));
+	}
+	assert(dirty_count <= max_buffers / 100 * 2 + 1);
+	assert(!flush_buffers(map3));
+	/* a buffer redirtied for a new delta is forked */
+	buffer = blockread(map3, 7);
+	blockdirty(buffer, 0);
+	memset(bufdata(buffer), 'x', bufsize(buffer));
+	blockdirty(buffer, 1);
+	assert(buffer->state == BUFFER_DIRTY + 1 && *(char *)bufdata(buffer) == 'x');
+	memset(bufdata(buffer), 'y', bufsize(buffer));
+	assert(!flush_state(BUFFER_DIRTY));
+	char c;
+	assert(!diskread(dev->fd, &c, 1, 7 << dev->bits) && c == 'x');
+	assert(!flush_buffers(map3));
+	assert(!diskread(dev->fd, &c, 1, 7 << dev->bits) && c == 'y');
+	brelse(buffer);
+	/* other io methods write ahead too, here block 8 is a fork being flushed */
+	map_t *map4 = new_map(dev, redirty_io);
+	for (int i = 8; i < 10; i++) {
+		buffer = blockget(map4, i);
+		memset(bufdata(buffer), 'p', bufsize(buffer));
+		if (i == 8)
+			set_buffer_state(buffer, BUFFER_DIRTY);
+		else
+			blockdirty(buffer, 0);
+		brelse(buffer);
+	}
+	assert(!flush_state(BUFFER_DIRTY));
+	buffer = peekblk(map4, 9);
+	assert(buffer->state == BUFFER_DIRTY + 1);
+	assert(!diskread(dev->fd, &c, 1, 9 << dev->bits) && c == 'p');
+	brelse(buffer);
+	assert(!flush_buffers(map4));
+	/* modelled memory volume */
+	struct diskstat stat;
+	int fd = diskopen("hdd,nosleep,seek=1000:ram:1m", O_RDWR, 0);
+	assert(fd >= 0 && diskopen("ram:1x", O_RDWR, 0) == -EINVAL);
+	assert(diskmemory("nvme:ram:1m") && !diskmemory("hdd:/tmp/ram:1m") && !diskmemory("/tmp/ram:1m"));
+	assert(!diskwrite(fd, &c, 1, 0) && !diskread(fd, &c, 1, 1 << 19));
+	assert(!diskstat(fd, &stat) && stat.requests == 2 && stat.bytes[0] == 1 && stat.bytes[1] == 1);
+	printf("modelled hdd busy %Lu ns\n", (L)stat.busy);
+	assert(stat.busy > 1000000 && !diskclose(fd));
 	exit(0);
 }
 #endif
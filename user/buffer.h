@@ -1,6 +1,7 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <time.h>
 #include "list.h"
 
 #define BUFFER_DIRTY_STATES 4
@@ -14,11 +15,36 @@ enum {
 
 typedef loff_t block_t; // disk io address range
 
-struct dev { unsigned fd, bits; };
+struct dev {
+	unsigned fd, bits;
+	unsigned datafd, metafd; /* O_DIRECT descriptors, zero to use fd */
+	void *base;	/* volume mapping for zero copy reads, if any */
+	loff_t size;	/* bytes mapped at base */
+};
+
+static inline unsigned dev_datafd(struct dev *dev)
+{
+	return dev->datafd ? dev->datafd : dev->fd;
+}
+
+static inline unsigned dev_metafd(struct dev *dev)
+{
+	return dev->metafd ? dev->metafd : dev->fd;
+}
 
 struct buffer_head;
+struct map;
 
 typedef int (blockio_t)(struct buffer_head *buffer, int write);
+typedef void (prefetch_t)(struct map *map, block_t block, unsigned count);
+typedef void (writeback_t)(struct map *map, unsigned count);
+
+struct readahead {
+	block_t last;		/* most recent block read */
+	block_t ahead;		/* first block not yet prefetched */
+	unsigned stride;	/* distance between reads in the stream */
+	unsigned window;	/* reads to prefetch next time, zero if none */
+};
 
 struct map {
 #if 1 /* tux3 only */
@@ -27,6 +53,9 @@ struct map {
 	struct list_head dirty;
 	struct dev *dev;
 	blockio_t *io;
+	prefetch_t *prefetch;
+	writeback_t *writeback;	/* count buffers about to be written, zero when done */
+	struct readahead ra;
 	struct hlist_head hash[BUFFER_BUCKETS];
 };
 
@@ -38,8 +67,10 @@ struct buffer_head {
 	struct list_head link;
 	struct list_head lru; /* used for LRU list and the free list */
 	unsigned count, state;
+	time_t dirtied;	/* when it last went from clean to dirty */
 	block_t index;
-	void *data;
+	void *data;	/* store, or the volume mapping while clean */
+	void *store;	/* private data block of this buffer */
 };
 
 struct buffer_head *new_buffer(map_t *map);
@@ -57,10 +88,17 @@ unsigned buffer_hash(block_t block);
 struct buffer_head *peekblk(map_t *map, block_t block);
 struct buffer_head *blockget(map_t *map, block_t block);
 struct buffer_head *blockread(map_t *map, block_t block);
+void blockprefetch(map_t *map, block_t block, unsigned count);
 int blockdirty(struct buffer_head *buffer, unsigned newdelta);
+int bufmap(struct buffer_head *buffer, block_t block);
+int flush_list(struct list_head *list);
 int flush_buffers(map_t *map);
 int flush_state(unsigned state);
+int balance_dirty_buffers(map_t *map);
+void set_writeback(unsigned background, unsigned limit, unsigned expire);
 void evict_buffers(map_t *map);
+unsigned set_flush_size(unsigned bytes);
+void set_readahead(unsigned min, unsigned max);
 void init_buffers(struct dev *dev, unsigned poolsize, int debug);
 
 static inline void *bufdata(struct buffer_head *buffer)
@@ -103,6 +141,8 @@ static inline int buffer_dirty(struct buffer_head *buffer)
 	return buffer->state >= BUFFER_DIRTY;
 }
 
+int dev_mmap(struct dev *dev);
+int dev_direct(struct dev *dev, const char *name, int metadata);
 map_t *new_map(struct dev *dev, blockio_t *io);
 void free_map(map_t *map);
 #endif
@@ -36,6 +36,7 @@ int cursor_redirect(struct cursor *cursor, unsigned level)
 	cursor->path[level].next += bufdata(clone) - bufdata(buffer);
 	log_redirect(sb, oldblock, newblock);
 	stash_free(&sb->defree, oldblock, 1);
+	btree->gen++;
 	brelse(buffer);
 
 	/* Update Parent */
@@ -43,9 +44,9 @@ int cursor_redirect(struct cursor *cursor, unsigned level)
 	if (level) {
 		struct index_entry *entry = cursor->path[level - 1].next - 1;
 		block_t parent = bufindex(cursor->path[level - 1].buffer);
-		assert(oldblock == from_be_u64(entry->block));
-		entry->block = to_be_u64(newblock);
-		log_update(sb, newblock, parent, from_be_u64(entry->key));
+		assert(oldblock == index_block(entry));
+		set_index_block(entry, newblock);
+		log_update(sb, newblock, parent, index_key(entry));
 		return 0;
 	}
 
@@ -174,7 +175,10 @@ int bitmap_io(struct buffer_head *buffer, int write)
 
 int main(int argc, char *argv[])
 {
-	struct dev *dev = &(struct dev){ .bits = 8, .fd = open(argv[1], O_CREAT|O_TRUNC|O_RDWR, S_IRWXU) };
+	fd_t fd = diskopen(argv[1], O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+	if (fd < 0)
+		error("could not open '%s' (%s)", argv[1], strerror(-fd));
+	struct dev *dev = &(struct dev){ .bits = 8, .fd = fd };
 	struct sb *sb = &(struct sb){ INIT_SB(dev), .volblocks = 100 };
 	ftruncate(dev->fd, 1 << 24);
 	sb->volmap = rapid_open_inode(sb, NULL, 0);
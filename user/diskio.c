@@ -1,14 +1,85 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/fs.h> // for BLKGETSIZE
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
 #include "trace.h"
 #include "diskio.h"
 
+/*
+ * Device models
+ *
+ * A volume opened through a model URI (see diskopen) has a latency and
+ * bandwidth model attached to its descriptor.  Each request is charged
+ * the time the modelled device would take for it, which is added to the
+ * device statistics and, unless the model says nosleep, actually waited
+ * out, so benchmarks see device cost in proportion to the cpu cost that
+ * the host disk would otherwise swamp.
+ */
+struct diskmodel {
+	int fd;
+	unsigned seek;		/* full stroke seek, microseconds */
+	unsigned latency;	/* per request, microseconds */
+	unsigned bandwidth;	/* megabytes per second */
+	unsigned depth;		/* requests serviced concurrently */
+	int sleep;
+	off_t head, size;
+	struct diskstat stat;
+	struct diskmodel *next;
+};
+
+static struct diskmodel *models;
+
+static const struct diskmodel presets[] = {
+	{ .seek = 8000, .latency = 4000, .bandwidth = 150, .depth = 1, .sleep = 1 }, /* hdd */
+	{ .latency = 80, .bandwidth = 3000, .depth = 32, .sleep = 1 }, /* nvme */
+};
+
+static struct diskmodel *diskmodel(int fd)
+{
+	for (struct diskmodel *model = models; model; model = model->next)
+		if (model->fd == fd)
+			return model;
+	return NULL;
+}
+
+/* Charge a request to the model of fd, if any; async requests overlap up to depth */
+static void diskmodel_io(int fd, off_t offset, size_t bytes, int write, int async)
+{
+	struct diskmodel *model;
+	if (!models || !(model = diskmodel(fd)))
+		return;
+	unsigned long long ns = model->latency * 1000ULL;
+	if (async && model->depth > 1)
+		ns /= model->depth;
+	if (model->seek && offset != model->head) {
+		off_t distance = offset > model->head ? offset - model->head : model->head - offset;
+		ns += model->seek * 100ULL + model->seek * 900ULL * distance / model->size;
+	}
+	if (model->bandwidth)
+		ns += bytes * 1000ULL / model->bandwidth;
+	model->head = offset + bytes;
+	model->stat.requests++;
+	model->stat.bytes[!!write] += bytes;
+	model->stat.busy += ns;
+	if (model->sleep)
+		nanosleep(&(struct timespec){ ns / 1000000000, ns % 1000000000 }, NULL);
+}
+
 static int ioabs(int fd, void *data, size_t count, int out, off_t offset)
 {
+	diskmodel_io(fd, offset, count, out, 0);
 	while (count) {
 		ssize_t ret;
 		if (out)
@@ -29,6 +100,72 @@ static int ioabs(int fd, void *data, size_t count, int out, off_t offset)
 	return 0;
 }
 
+static int rwf_flags(unsigned flags)
+{
+	int rwf = 0;
+#ifdef RWF_HIPRI
+	if (flags & DISKIO_HIPRI)
+		rwf |= RWF_HIPRI;
+#endif
+#ifdef RWF_DSYNC
+	if (flags & DISKIO_DSYNC)
+		rwf |= RWF_DSYNC;
+#endif
+	return rwf;
+}
+
+/*
+ * Scatter/gather io.  Flags go to preadv2/pwritev2 where the C library
+ * and kernel have them.  Otherwise DISKIO_DSYNC is done by fdatasync after
+ * the write, and DISKIO_HIPRI, being only a hint, is dropped.
+ *
+ * Note: advances the caller's iovec over short transfers
+ */
+static int ioabsv(int fd, struct iovec *iov, int iovcnt, int out, off_t offset, unsigned flags)
+{
+	int rwf = rwf_flags(flags);
+	while (iovcnt) {
+		int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t ret;
+#ifdef RWF_HIPRI
+		if (rwf) {
+			if (out)
+				ret = pwritev2(fd, iov, count, offset, rwf);
+			else
+				ret = preadv2(fd, iov, count, offset, rwf);
+			if (ret == -1 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+				rwf = 0;
+				continue;
+			}
+		} else
+#endif
+		if (out)
+			ret = pwritev(fd, iov, count, offset);
+		else
+			ret = preadv(fd, iov, count, offset);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		offset += ret;
+		while (iovcnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (ret) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	if (out && (flags & DISKIO_DSYNC) && !(rwf & rwf_flags(DISKIO_DSYNC)))
+		return fdatasync(fd) ? -errno : 0;
+	return 0;
+}
+
 static int iorel(int fd, void *data, size_t count, int out)
 {
 	while (count) {
@@ -60,6 +197,297 @@ int diskwrite(int fd, void *data, size_t count, off_t offset)
 	return ioabs(fd, data, count, 1, offset);
 }
 
+static void diskmodel_iov(int fd, struct iovec *iov, int iovcnt, off_t offset, int write, int async)
+{
+	if (models) {
+		size_t bytes = 0;
+		for (int i = 0; i < iovcnt; i++)
+			bytes += iov[i].iov_len;
+		diskmodel_io(fd, offset, bytes, write, async);
+	}
+}
+
+int diskreadv(int fd, struct iovec *iov, int iovcnt, off_t offset, unsigned flags)
+{
+	diskmodel_iov(fd, iov, iovcnt, offset, 0, 0);
+	return ioabsv(fd, iov, iovcnt, 0, offset, flags);
+}
+
+int diskwritev(int fd, struct iovec *iov, int iovcnt, off_t offset, unsigned flags)
+{
+	diskmodel_iov(fd, iov, iovcnt, offset, 1, 0);
+	return ioabsv(fd, iov, iovcnt, 1, offset, flags);
+}
+
+/*
+ * Asynchronous io
+ *
+ * Requests go to the kernel through native aio, which only truly runs in
+ * the background on O_DIRECT descriptors; for buffered io the submit does
+ * the work.  Completions are delivered by diskcomplete, in the caller's
+ * context, never from a signal or another thread, so end_io methods may
+ * use the buffer cache.  Where kernel aio is not available the request is
+ * done at submit and its completion queued for diskcomplete all the same.
+ */
+#define AIO_DEPTH 128
+#define AIO_EVENTS 32
+
+static aio_context_t aio_ctx;
+static int aio_state; /* zero untried, one working, negative unavailable */
+static unsigned aio_inflight;
+static struct diskreq *aio_done, **aio_done_tail = &aio_done;
+
+static void diskreq_done(struct diskreq *req, int err)
+{
+	req->err = err;
+	req->next = NULL;
+	*aio_done_tail = req;
+	aio_done_tail = &req->next;
+}
+
+static int diskreq_sync(struct diskreq *req)
+{
+	diskreq_done(req, ioabsv(req->fd, req->iov, req->iovcnt, req->write, req->offset, req->flags));
+	return 0;
+}
+
+/* Finish a request after the kernel has transferred res bytes of it */
+static int diskreq_finish(struct diskreq *req, long long res)
+{
+	if (res < 0)
+		return res;
+	struct iovec *iov = req->iov;
+	int iovcnt = req->iovcnt;
+	off_t offset = req->offset + res;
+	while (iovcnt && res >= iov->iov_len) {
+		res -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	}
+	if (!iovcnt)
+		return req->write && (req->flags & DISKIO_DSYNC) && fdatasync(req->fd) ? -errno : 0;
+	if (res) {
+		iov->iov_base += res;
+		iov->iov_len -= res;
+	}
+	return ioabsv(req->fd, iov, iovcnt, req->write, offset, req->flags);
+}
+
+/* May deliver earlier completions to make room in the queue */
+int disksubmit(struct diskreq *req)
+{
+	diskmodel_iov(req->fd, req->iov, req->iovcnt, req->offset, req->write, 1);
+	if (!aio_state)
+		aio_state = syscall(SYS_io_setup, AIO_DEPTH, &aio_ctx) ? -errno : 1;
+	if (aio_state < 0 || req->iovcnt > IOV_MAX)
+		return diskreq_sync(req);
+	req->iocb = (struct iocb){
+		.aio_data = (uintptr_t)req,
+		.aio_lio_opcode = req->write ? IOCB_CMD_PWRITEV : IOCB_CMD_PREADV,
+		.aio_fildes = req->fd,
+		.aio_buf = (uintptr_t)req->iov,
+		.aio_nbytes = req->iovcnt,
+		.aio_offset = req->offset,
+	};
+	struct iocb *list[1] = { &req->iocb };
+	while (1) {
+		if (syscall(SYS_io_submit, aio_ctx, 1, list) == 1) {
+			aio_inflight++;
+			return 0;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN && aio_inflight) {
+			int err = diskcomplete(1);
+			if (err < 0)
+				return err;
+			continue;
+		}
+		return diskreq_sync(req); /* kernel will not take it, do it now */
+	}
+}
+
+/*
+ * Deliver completed requests.  With wait, do not return until every
+ * submitted request has completed.  Returns the number delivered.
+ */
+int diskcomplete(int wait)
+{
+	struct io_event events[AIO_EVENTS];
+	int count = 0;
+	while (1) {
+		while (aio_done) {
+			struct diskreq *req = aio_done;
+			if (!(aio_done = req->next))
+				aio_done_tail = &aio_done;
+			req->end_io(req, req->err);
+			count++;
+		}
+		if (!aio_inflight || (!wait && count))
+			return count;
+		int ret = syscall(SYS_io_getevents, aio_ctx, wait ? 1 : 0, AIO_EVENTS, events, NULL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return count;
+		for (int i = 0; i < ret; i++) {
+			struct diskreq *req = (void *)(uintptr_t)events[i].data;
+			aio_inflight--;
+			diskreq_done(req, diskreq_finish(req, events[i].res));
+		}
+	}
+}
+
+/* Start reading into the page cache without waiting for it */
+int diskprefetch(int fd, size_t count, off_t offset)
+{
+	return -posix_fadvise(fd, offset, count, POSIX_FADV_WILLNEED);
+}
+
+static int parse_size(const char *text, off_t *size)
+{
+	char *end;
+	unsigned long long n = strtoull(text, &end, 0);
+	switch (*end) {
+	case 'g': case 'G': n <<= 10; /* fall through */
+	case 'm': case 'M': n <<= 10; /* fall through */
+	case 'k': case 'K': n <<= 10; end++;
+	}
+	if (end == text || *end)
+		return -EINVAL;
+	*size = n;
+	return 0;
+}
+
+static int model_option(struct diskmodel *model, const char *opt, int len)
+{
+	static const struct { const char *name; size_t where; } names[] = {
+		{ "seek", offsetof(struct diskmodel, seek) },
+		{ "latency", offsetof(struct diskmodel, latency) },
+		{ "bw", offsetof(struct diskmodel, bandwidth) },
+		{ "depth", offsetof(struct diskmodel, depth) },
+	};
+	if (len == 7 && !memcmp(opt, "nosleep", 7)) {
+		model->sleep = 0;
+		return 0;
+	}
+	for (int i = 0; i < sizeof(names) / sizeof(*names); i++) {
+		int n = strlen(names[i].name);
+		if (len > n && opt[n] == '=' && !memcmp(opt, names[i].name, n)) {
+			*(unsigned *)((void *)model + names[i].where) = strtoul(opt + n + 1, NULL, 0);
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/*
+ * Open a volume by name or URI:
+ *
+ *   ram:<size>			anonymous memory, size may end in k, m or g
+ *   hdd[,<opts>]:<volume>	seek, rotation and bandwidth model over volume
+ *   nvme[,<opts>]:<volume>	latency, queue depth and bandwidth model
+ *   <path>			plain file or device
+ *
+ * Model options are seek=, latency= (microseconds), bw= (MB/s), depth=
+ * and nosleep, for instance "hdd,seek=12000:ram:1g".  Returns a file
+ * descriptor or negative errno.
+ */
+int diskopen(const char *uri, int flags, mode_t mode)
+{
+	static const char *schemes[] = { "hdd", "nvme" };
+	if (!strncmp(uri, "ram:", 4)) {
+		off_t size;
+		if ((flags & O_DIRECT) || parse_size(uri + 4, &size))
+			return -EINVAL;
+		int fd = memfd_create(uri, 0);
+		if (fd < 0)
+			return -errno;
+		if (ftruncate(fd, size)) {
+			close(fd);
+			return -errno;
+		}
+		return fd;
+	}
+	for (int i = 0; i < sizeof(schemes) / sizeof(*schemes); i++) {
+		int n = strlen(schemes[i]);
+		if (strncmp(uri, schemes[i], n) || (uri[n] != ':' && uri[n] != ','))
+			continue;
+		struct diskmodel *model = malloc(sizeof(*model));
+		if (!model)
+			return -ENOMEM;
+		*model = presets[i];
+		const char *opt = uri + n, *volume = strchr(opt, ':');
+		if (!volume)
+			goto einval;
+		while (opt < volume) {
+			const char *next = memchr(opt + 1, ',', volume - opt - 1);
+			if (!next)
+				next = volume;
+			if (model_option(model, opt + 1, next - opt - 1))
+				goto einval;
+			opt = next;
+		}
+		int fd = diskopen(volume + 1, flags, mode);
+		if (fd < 0) {
+			free(model);
+			return fd;
+		}
+		uint64_t size = 0;
+		fdsize64(fd, &size);
+		model->fd = fd;
+		model->size = size ? size : 1 << 30;
+		model->next = models;
+		models = model;
+		return fd;
+einval:
+		free(model);
+		return -EINVAL;
+	}
+	int fd = open(uri, flags, mode);
+	return fd < 0 ? -errno : fd;
+}
+
+/* Does uri name a memory volume, directly or under a model? */
+int diskmemory(const char *uri)
+{
+	static const char *schemes[] = { "hdd", "nvme" };
+	for (int i = 0; i < sizeof(schemes) / sizeof(*schemes); i++) {
+		int n = strlen(schemes[i]);
+		if (!strncmp(uri, schemes[i], n) && (uri[n] == ':' || uri[n] == ',')) {
+			const char *volume = strchr(uri + n, ':');
+			return volume && diskmemory(volume + 1);
+		}
+	}
+	return !strncmp(uri, "ram:", 4);
+}
+
+/* Return the statistics of a modelled volume */
+int diskstat(int fd, struct diskstat *stat)
+{
+	struct diskmodel *model = diskmodel(fd);
+	if (!model)
+		return -ENOENT;
+	*stat = model->stat;
+	return 0;
+}
+
+int diskclose(int fd)
+{
+	for (struct diskmodel **link = &models; *link; link = &(*link)->next) {
+		if ((*link)->fd == fd) {
+			struct diskmodel *model = *link;
+			*link = model->next;
+			free(model);
+			break;
+		}
+	}
+	return close(fd) ? -errno : 0;
+}
+
 int streamread(int fd, void *data, size_t count)
 {
 	return iorel(fd, data, count, 0);
@@ -1,9 +1,45 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/aio_abi.h>
+
+enum { DISKIO_HIPRI = 1, DISKIO_DSYNC = 2 };
+
+/* An asynchronous scatter/gather request, see disksubmit */
+struct diskreq {
+	int fd, write;
+	struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	unsigned flags;
+	void (*end_io)(struct diskreq *req, int err);
+	void *info;
+	/* private */
+	int err;
+	struct diskreq *next;
+	struct iocb iocb;
+};
 
+/* Modelled device activity, see diskopen */
+struct diskstat {
+	unsigned long long requests, bytes[2], busy; /* bytes read, written; busy ns */
+};
+
+int diskopen(const char *uri, int flags, mode_t mode);
+int diskmemory(const char *uri);
+int diskstat(int fd, struct diskstat *stat);
+int diskclose(int fd);
 int diskread(int fd, void *data, size_t count, off_t offset);
 int diskwrite(int fd, void *data, size_t count, off_t offset);
+int diskreadv(int fd, struct iovec *iov, int iovcnt, off_t offset, unsigned flags);
+int diskwritev(int fd, struct iovec *iov, int iovcnt, off_t offset, unsigned flags);
+int disksubmit(struct diskreq *req);
+int diskcomplete(int wait);
+int diskprefetch(int fd, size_t count, off_t offset);
 int streamread(int fd, void *data, size_t count);
 int streamwrite(int fd, void *data, size_t count);
 int fdsize64(int fd, uint64_t *size);
-
+#endif
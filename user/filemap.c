@@ -15,6 +15,9 @@
 #include "kernel/balloc.c"
 #include "kernel/filemap.c"
 
+/* Largest transfer guess_region aims for, in bytes */
+#define MAX_REGION (1 << 20)
+
 /*
  * Extrapolate from single buffer flush or blockread to opportunistic exent IO
  *
@@ -31,8 +34,11 @@ void guess_region(struct buffer_head *buffer, block_t *start, unsigned *count, i
 {
 	struct inode *inode = buffer_inode(buffer);
 	block_t ends[2] = { bufindex(buffer), bufindex(buffer) };
+	unsigned most = max(MAX_EXTENT, MAX_REGION >> buffer->map->dev->bits);
+	if (!write && buffer->map->ra.stride == 1 && buffer->map->ra.window > most)
+		most = buffer->map->ra.window; /* streaming, read the whole window */
 	for (int up = !write; up < 2; up++) {
-		while (ends[1] - ends[0] + 1 < MAX_EXTENT) {
+		while (ends[1] - ends[0] + 1 < most) {
 			block_t next = ends[up] + (up ? 1 : -1);
 			struct buffer_head *nextbuf = peekblk(buffer->map, next);
 			if (!nextbuf) {
@@ -53,6 +59,81 @@ void guess_region(struct buffer_head *buffer, block_t *start, unsigned *count, i
 	*count = ends[1] + 1 - ends[0];
 }
 
+/*
+ * Transfer count blocks at logical index, physically contiguous from
+ * seg->block, as a single request.  Holes and unwritten extents read as
+ * zeros without io.  If the buffer pool runs dry the request is cut short
+ * at the buffers obtained.  Returns the number of blocks transferred or
+ * negative errno.
+ */
+static int filemap_seg_io(struct inode *inode, unsigned fd, block_t index, struct seg *seg, unsigned count, int write)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct dev *dev = sb->dev;
+	int hole = seg->state & (SEG_HOLE | SEG_UNWRITTEN), err = 0;
+	trace("extent 0x%Lx/%x => %Lx state => %Lx", (L)index, count, (L)seg->block, (L)seg->state);
+	struct buffer_head **bufvec = malloc(count * (sizeof(*bufvec) + sizeof(struct iovec)));
+	if (!bufvec)
+		return -ENOMEM;
+	struct iovec *iov = (void *)(bufvec + count);
+	for (int j = 0; j < count; j++) {
+		if (!(bufvec[j] = blockget(mapping(inode), index + j))) {
+			count = j;
+			break;
+		}
+		iov[j] = (struct iovec){ .iov_base = bufdata(bufvec[j]), .iov_len = sb->blocksize };
+	}
+	if (!count) {
+		free(bufvec);
+		return -ENOMEM;
+	}
+	if (write) {
+		if (seg->state != SEG_DUP) /* DREAMZ */
+			err = diskwritev(fd, iov, count, seg->block << dev->bits, 0);
+		else
+			warn("Duplicate block not written");
+	} else if (hole) {
+		for (int j = 0; j < count; j++)
+			memset(bufdata(bufvec[j]), 0, sb->blocksize);
+	} else if (dev->base) {
+		for (int j = 0; !err && j < count; j++)
+			if (!bufmap(bufvec[j], seg->block + j))
+				err = diskread(fd, bufdata(bufvec[j]), sb->blocksize, (seg->block + j) << dev->bits);
+	} else
+		err = diskreadv(fd, iov, count, seg->block << dev->bits, 0);
+
+	for (int j = 0; j < count; j++) {
+		struct buffer_head *buffer = bufvec[j];
+		trace("block 0x%Lx => %Lx", (L)bufindex(buffer), (L)seg->block + j);
+		if (!write && !hole && !err && sb->readcheck == 1) {
+			unsigned char *hash;
+			block_t blk;
+			struct buffer_head* buffer;
+			if( inode->inum > 4 && inode->inum != 10 && inode->inum != 13) {
+				buffer = (blockget(mapping(inode),index)); /* DREAMZ */
+				hash = (unsigned char *)malloc(sizeof(unsigned char) * SHA_DIGEST_LENGTH);
+				hash = SHA1(bufdata(buffer),inode->i_sb->blocksize,hash); 
+				brelse(buffer);
+				blk = hash_lookup(inode, hash);
+				if(blk != seg->block + j)
+					err = -EIO;
+			}
+		}
+		brelse(set_buffer_clean(buffer)); // leave empty if error ???
+	}
+	free(bufvec);
+	return err ? err : count;
+}
+
+/* Segments that can be transferred together with the one before them */
+static int seg_merge(struct seg *prev, struct seg *seg)
+{
+	unsigned zero = SEG_HOLE | SEG_UNWRITTEN;
+	if ((prev->state | seg->state) & (zero | SEG_DUP))
+		return (prev->state & zero) && (seg->state & zero);
+	return prev->block + prev->count == seg->block;
+}
+
 int filemap_extent_io(struct buffer_head *buffer, int write)
 {
 	struct inode *inode = buffer_inode(buffer);
@@ -72,66 +153,86 @@ int filemap_extent_io(struct buffer_head *buffer, int write)
 	guess_region(buffer, &start, &count, write);
 	printf("---- extent 0x%Lx/%x ----\n", (L)start, count);
 
-	struct seg map[10];
-
-	int segs = map_region(inode, start, count, map, ARRAY_SIZE(map), write);
-	if (segs < 0)
-		return segs;
-
-	if (!segs) {
-		if (!write) {
-			trace("unmapped block %Lx", (L)bufindex(buffer));
-			memset(bufdata(buffer), 0, sb->blocksize);
-			set_buffer_clean(buffer);
-			return 0;
-		}
-		return -EIO;
-	}
+	/* a region never maps to more segments than blocks */
+	struct seg *map = malloc(count * sizeof(*map));
+	if (!map)
+		return -ENOMEM;
 
+	/* regular file data may go direct, other file maps are metadata */
+	unsigned fd = S_ISREG(inode->i_mode) ? dev_datafd(dev) : dev_metafd(dev);
+	block_t index = start, limit = start + count;
 	int err = 0;
-	for (int i = 0, index = start; !err && i < segs; i++) {
-		int hole = map[i].state == SEG_HOLE;
-		trace("extent 0x%Lx/%x => %Lx state => %Lx", (L)index, map[i].count, (L)map[i].block, (L)map[i].state);
-		for (int j = 0; !err && j < map[i].count; j++) {
-			block_t block = map[i].block + j;
-			buffer = blockget(mapping(inode), index + j);
-			trace("block 0x%Lx => %Lx", (L)bufindex(buffer), (L)block);
-			if (write) {
-				if (map[i].state != SEG_DUP) /* DREAMZ */
-					err = diskwrite(dev->fd, bufdata(buffer), sb->blocksize, block << dev->bits);
-				else
-					warn("Duplicate block not written");					
-			}else {
-				if (hole)
-					memset(bufdata(buffer), 0, sb->blocksize);
-				else{
-					err = diskread(dev->fd, bufdata(buffer), sb->blocksize, block << dev->bits);
-					if(sb->readcheck == 1){
-						unsigned char *hash;
-						block_t blk;
-						struct buffer_head* buffer;
-						if( inode->inum > 4 && inode->inum != 10 && inode->inum != 13) {
-							buffer = (blockget(mapping(inode),start)); /* DREAMZ */
-							hash = (unsigned char *)malloc(sizeof(unsigned char) * SHA_DIGEST_LENGTH);
-							hash = SHA1(bufdata(buffer),inode->i_sb->blocksize,hash); 
-							brelse(buffer);
-							blk = hash_lookup(inode, hash);
-							if(blk != block)
-								return -EIO;
-						}
-					}
-				}
+	/* nothing may be mapped where a pending truncate will chop */
+	if (write && (tux_inode(inode)->present & ORPHAN_BIT) && limit > tux_inode(inode)->chop.key)
+		err = orphan_finish(inode);
+	while (!err && index < limit) {
+		/* map_region stops at a leaf boundary, so go around until covered */
+		int segs = map_region(inode, index, limit - index, map, count, write);
+		if (segs <= 0) {
+			if (segs < 0)
+				err = segs;
+			else if (write)
+				err = -EIO;
+			else if (buffer_empty(buffer)) {
+				trace("unmapped block %Lx", (L)bufindex(buffer));
+				memset(bufdata(buffer), 0, sb->blocksize);
+				set_buffer_clean(buffer);
 			}
-			brelse(set_buffer_clean(buffer)); // leave empty if error ???
+			break;
+		}
+		for (int i = 0, j; !err && i < segs; i = j) {
+			unsigned total = map[i].count;
+			for (j = i + 1; j < segs && seg_merge(&map[j - 1], &map[j]); j++)
+				total += map[j].count;
+			int done = filemap_seg_io(inode, fd, index, &map[i], total, write);
+			if (done < 0)
+				err = done;
+			else
+				index += done;
+			if (done != total)
+				break; /* short, map the rest again */
 		}
-		index += map[i].count;
 	}
+	free(map);
 	return err;
 }
 
+/*
+ * Readahead for file maps: map the window without allocating and hint
+ * the physical extents to the page cache.  Holes need no io.
+ */
+void filemap_prefetch(map_t *map, block_t start, unsigned count)
+{
+	struct inode *inode = map->inode;
+	struct sb *sb = tux_sb(inode->i_sb);
+	block_t limit = (inode->i_size + sb->blockmask) >> sb->blockbits;
+	if (start >= limit || sb->dev->datafd)
+		return;
+	if (count > limit - start)
+		count = limit - start;
+	struct seg *seg = malloc(count * sizeof(*seg));
+	if (!seg)
+		return;
+	int segs = map_region(inode, start, count, seg, count, 0);
+	for (int i = 0; i < segs; i++)
+		if (!(seg[i].state & (SEG_HOLE | SEG_UNWRITTEN)))
+			diskprefetch(sb->dev->fd, (size_t)seg[i].count << sb->blockbits, seg[i].block << sb->blockbits);
+	free(seg);
+}
+
+/* Writeback of a regular file claims one run for the blocks it writes */
+void filemap_writeback(map_t *map, unsigned count)
+{
+	if (count)
+		set_data_goal(map->inode, count);
+	else
+		put_data_goal(map->inode);
+}
+
 #ifdef build_filemap
 void change_begin(struct sb *sb) { }
 void change_end(struct sb *sb) { }
+int orphan_finish(struct inode *inode) { return 0; }
 
 static void check_created_seg(struct seg *seg)
 {
@@ -187,7 +288,9 @@ int main(int argc, char *argv[])
 	if (argc < 2)
 		error("usage: %s <volname>", argv[0]);
 	char *name = argv[1];
-	fd_t fd = open(name, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+	fd_t fd = diskopen(name, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+	if (fd < 0)
+		error("could not open '%s' (%s)", name, strerror(-fd));
 	ftruncate(fd, 1 << 24);
 	u64 size = 0;
 	if (fdsize64(fd, &size))
@@ -196,7 +299,7 @@ int main(int argc, char *argv[])
 	struct sb *sb = &(struct sb){
 		INIT_SB(dev),
 		.max_inodes_per_block = 64,
-		.entries_per_node = 20,
+		.entries_per_node = bnode_fanout(1 << dev->bits),
 		.volblocks = size >> dev->bits,
 	};
 	sb->volmap = rapid_open_inode(sb, NULL, 0);
@@ -40,6 +40,10 @@ void free_inode(struct inode *inode)
 	free_map(mapping(inode)); // invalidate dirty buffers!!!
 	if (inode->xcache)
 		free(inode->xcache);
+	invalidate_extents(inode);
+	drop_cursor(&inode->btree);
+	if (!hlist_unhashed(&inode->orphan))
+		hlist_del(&inode->orphan);
 	free(inode);
 }
 
@@ -48,8 +52,12 @@ void free_inode(struct inode *inode)
 static void tux_setup_inode(struct inode *inode, dev_t rdev)
 {
 	inode->i_rdev = rdev;
-	if (inode->inum != TUX_VOLMAP_INO)
+	if (inode->inum != TUX_VOLMAP_INO) {
 		inode->map->io = filemap_extent_io;
+		/* other file maps may be read under their own btree lock */
+		inode->map->prefetch = S_ISREG(inode->i_mode) ? filemap_prefetch : NULL;
+		inode->map->writeback = S_ISREG(inode->i_mode) ? filemap_writeback : NULL;
+	}
 }
 
 struct inode *iget(struct sb *sb, inum_t inum)
@@ -81,6 +89,8 @@ int tuxio(struct file *file, char *data, unsigned len, int write)
 		unsigned from = pos & bmask;
 		unsigned some = from + tail > bsize ? bsize - from : tail;
 		int full = write && some == bsize;
+		if (write && (err = balance_dirty_buffers(mapping(inode))))
+			break;
 		struct buffer_head *buffer = (full ? blockget : blockread)(mapping(inode), pos >> bbits);
 		if (!buffer) {
 			err = -EIO;
@@ -166,6 +176,218 @@ error:
 	return NULL; // err ???
 }
 
+/*
+ * Deferred truncate.  Chopping a big file down can take a long time, so
+ * truncate and unlink only note where the file now ends and queue the
+ * inode as an orphan, and reclaim_orphans chops later, a time slice at a
+ * time, each slice going on where the last stopped.  The chop point is
+ * saved with the inode as ORPHAN_ATTR, and the inode is listed in the
+ * orphan directory by inode number, until the chop is done.  After a
+ * crash load_orphans goes through just that list; chopping again from
+ * the start is harmless.  Until then map_region reads blocks past the
+ * chop point as a hole, and writeback finishes the chop before it maps
+ * any there.  The queue owns unlinked orphans.
+ */
+static int orphan_list(struct inode *inode, int add)
+{
+	struct inode *dir = tux_sb(inode->i_sb)->orphandir;
+	char name[17];
+	int len = sprintf(name, "%Lx", (L)inode->inum);
+	if (add) {
+		loff_t where = tux_create_entry(dir, name, len, inode->inum, inode->i_mode);
+		return where < 0 ? where : 0;
+	}
+	struct buffer_head *buffer;
+	tux_dirent *entry = tux_find_entry(dir, name, len, &buffer);
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+	return tux_delete_entry(buffer, entry);
+}
+
+static int orphan_add(struct inode *inode)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	tuxkey_t key = (inode->i_size + sb->blockmask) >> sb->blockbits;
+	if (!(inode->present & ORPHAN_BIT)) {
+		int err = orphan_list(inode, 1);
+		if (err)
+			return err;
+		inode->chop = (struct delete_info){ .key = key };
+	} else if (key < inode->chop.key)
+		inode->chop = (struct delete_info){ .key = key };
+	inode->present |= ORPHAN_BIT;
+	if (hlist_unhashed(&inode->orphan))
+		hlist_add_head(&inode->orphan, &sb->orphans);
+	return 0;
+}
+
+static int orphan_chop(struct inode *inode, millisecond_t deadline)
+{
+	if (!(inode->present & ORPHAN_BIT))
+		return 0;
+	if (inode->btree.root.depth) {
+		int err = tree_chop(&inode->btree, &inode->chop, deadline);
+		if (err)
+			return err;
+	}
+	inode->present &= ~ORPHAN_BIT;
+	int err = orphan_list(inode, 0);
+	if (err)
+		return err;
+	/* unlinked ones leave the inode table instead */
+	return inode->i_nlink ? save_inode(inode) : 0;
+}
+
+/* Blocks past the truncate point must be gone before any are mapped again */
+int orphan_finish(struct inode *inode)
+{
+	int err = orphan_chop(inode, 0);
+	if (!err && inode->i_nlink && !hlist_unhashed(&inode->orphan))
+		hlist_del_init(&inode->orphan);
+	return err;
+}
+
+/*
+ * Chop orphans until the deadline passes, zero for no deadline, dropping
+ * unlinked ones from the inode table when done.  Returns the number left
+ * to do, or negative error.
+ */
+int reclaim_orphans(struct sb *sb, millisecond_t deadline)
+{
+	struct hlist_node *node, *next;
+	int left = 0, late = 0, err;
+	hlist_for_each_safe(node, next, &sb->orphans) {
+		struct inode *inode = hlist_entry(node, struct inode, orphan);
+		if (late) {
+			left++;
+			continue;
+		}
+		err = orphan_chop(inode, deadline);
+		late = deadline && (int)(millitime() - deadline) >= 0;
+		if (err < 0)
+			return err;
+		if (err) {
+			left++;
+			continue;
+		}
+		hlist_del_init(&inode->orphan);
+		if (!inode->i_nlink) {
+			err = purge_inum(sb, inode->inum);
+			free_inode(inode);
+			if (err)
+				return err;
+		}
+	}
+	return left;
+}
+
+struct orphan_scan { inum_t *inums; unsigned count, max; int err; };
+
+static int find_orphan(void *state, char *name, unsigned len, loff_t pos, unsigned ino, unsigned type)
+{
+	struct orphan_scan *scan = state;
+	char text[17] = { };
+	if (scan->count == scan->max) {
+		unsigned max = scan->max ? 2 * scan->max : 16;
+		inum_t *inums = realloc(scan->inums, max * sizeof(*inums));
+		if (!inums) {
+			scan->err = -ENOMEM;
+			return 1;
+		}
+		scan->inums = inums;
+		scan->max = max;
+	}
+	memcpy(text, name, min(len, (unsigned)sizeof(text) - 1));
+	scan->inums[scan->count++] = strtoull(text, NULL, 16);
+	return 0;
+}
+
+/*
+ * Find the truncates a crash left unfinished, in the orphan directory.
+ * Linked orphans are chopped right away, unlinked ones are queued again
+ * for reclaim_orphans.  Entries a crash left behind a finished chop are
+ * dropped.
+ */
+int load_orphans(struct sb *sb)
+{
+	struct orphan_scan scan = { };
+	int err;
+	if (!sb->orphandir) {
+		if (!(sb->orphandir = iget(sb, TUX_ORPHAN_INO)))
+			return -ENOMEM;
+		if ((err = open_inode(sb->orphandir)))
+			return err;
+	}
+	struct file *file = &(struct file){ .f_inode = sb->orphandir };
+	if (!(err = tux_readdir(file, &scan, find_orphan)))
+		err = scan.err;
+	for (unsigned i = 0; !err && i < scan.count; i++) {
+		struct inode *inode = iget(sb, scan.inums[i]);
+		if (!inode) {
+			err = -ENOMEM;
+			break;
+		}
+		if ((err = open_inode(inode)) == -ENOENT || (!err && !(inode->present & ORPHAN_BIT))) {
+			err = orphan_list(inode, 0);
+			goto free;
+		}
+		if (err)
+			goto free;
+		if (!inode->i_nlink) {
+			hlist_add_head(&inode->orphan, &sb->orphans);
+			continue;
+		}
+		err = orphan_finish(inode);
+free:
+		free_inode(inode);
+	}
+	free(scan.inums);
+	return err;
+}
+
+int tuxtruncate(struct inode *inode, loff_t size)
+{
+	if (size < 0)
+		return -EINVAL;
+	/* only a shrink leaves blocks to chop */
+	int err, shrink = size < inode->i_size;
+	inode->i_size = size;
+	if (shrink && (err = orphan_add(inode)))
+		return err;
+	return save_inode(inode);
+}
+
+int tuxunlink(struct inode *dir, const char *name, int len)
+{
+	struct buffer_head *buffer;
+	tux_dirent *entry = tux_find_entry(dir, name, len, &buffer);
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+	struct inode *inode = iget(dir->i_sb, from_be_u64(entry->inum));
+	int err = -ENOMEM;
+	if (!inode)
+		goto error;
+	if ((err = open_inode(inode)))
+		goto error_inode;
+	if (!(err = tux_delete_entry(buffer, entry))) {
+		inode->i_nlink = 0;
+		inode->i_size = 0;
+		if (!(err = orphan_add(inode)))
+			err = save_inode(inode);
+	}
+	if (err) {
+		free_inode(inode);
+		return err;
+	}
+	return 0;
+
+error_inode:
+	free_inode(inode);
+error:
+	brelse(buffer);
+	return err;
+}
+
 int tuxflush(struct inode *inode)
 {
 	return flush_buffers(mapping(inode));
@@ -179,8 +401,166 @@ int tuxsync(struct inode *inode)
 	return save_inode(inode);
 }
 
+static int index_compare(const void *a, const void *b)
+{
+	block_t x = *(block_t *)a, y = *(block_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Map file blocks to volume extents, like FIEMAP, without forcing
+ * writeback.  Dirty blocks in holes show as SEG_DELAYED data with no
+ * block, dirty blocks in unwritten extents as written.  Returns the
+ * number of segs, which may cover less than count.
+ */
+int tuxmap(struct inode *inode, block_t start, unsigned count, struct seg map[], unsigned max_segs)
+{
+	block_t limit = start + count, index = start, *dirty = NULL;
+	struct buffer_head *buffer;
+	unsigned dirties = 0, d = 0;
+	int segs, out = 0;
+	list_for_each_entry(buffer, &mapping(inode)->dirty, link)
+		dirties += bufindex(buffer) >= start && bufindex(buffer) < limit;
+	struct seg *seg = malloc(max_segs * sizeof(*seg) + dirties * sizeof(*dirty));
+	if (!seg)
+		return -ENOMEM;
+	dirty = (block_t *)(seg + max_segs);
+	dirties = 0;
+	list_for_each_entry(buffer, &mapping(inode)->dirty, link)
+		if (bufindex(buffer) >= start && bufindex(buffer) < limit)
+			dirty[dirties++] = bufindex(buffer);
+	qsort(dirty, dirties, sizeof(*dirty), index_compare);
+	if ((segs = map_region(inode, start, count, seg, max_segs, 0)) < 0)
+		goto out;
+	if (!segs) /* no data btree yet */
+		seg[segs++] = (struct seg){ .count = count, .state = SEG_HOLE };
+	for (int i = 0; i < segs && out < max_segs; index += seg[i++].count) {
+		block_t at = index, end = index + seg[i].count;
+		if (!(seg[i].state & (SEG_HOLE | SEG_UNWRITTEN))) {
+			map[out++] = seg[i];
+			continue;
+		}
+		while (d < dirties && dirty[d] < at)
+			d++;
+		while (at < end && out < max_segs) {
+			int data = d < dirties && dirty[d] == at;
+			block_t next = at;
+			if (data)
+				while (next < end && d < dirties && dirty[d] == next)
+					next++, d++;
+			else
+				next = d < dirties && dirty[d] < end ? dirty[d] : end;
+			struct seg piece = seg[i];
+			if (!(piece.state & SEG_HOLE))
+				piece.block += at - index;
+			piece.count = next - at;
+			if (data)
+				piece.state = piece.state & SEG_HOLE ? SEG_DELAYED : piece.state & ~SEG_UNWRITTEN;
+			map[out++] = piece;
+			at = next;
+		}
+	}
+	segs = out;
+out:
+	free(seg);
+	return segs;
+}
+
+/* Find the next data or hole at or after pos, unwritten extents are holes */
+static loff_t seek_data_hole(struct inode *inode, loff_t pos, int hole)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= inode->i_size)
+		return -ENXIO;
+	block_t index = pos >> sb->blockbits;
+	block_t limit = (inode->i_size + sb->blockmask) >> sb->blockbits;
+	while (index < limit) {
+		struct seg map[16];
+		int segs = tuxmap(inode, index, min(limit - index, (block_t)INT_MAX), map, ARRAY_SIZE(map));
+		if (segs < 0)
+			return segs;
+		if (!segs)
+			break;
+		for (int i = 0; i < segs; index += map[i++].count)
+			if (!!(map[i].state & (SEG_HOLE | SEG_UNWRITTEN)) == hole)
+				return max(pos, (loff_t)index << sb->blockbits);
+	}
+	/* there is an implicit hole at end of file */
+	return hole ? inode->i_size : -ENXIO;
+}
+
+loff_t tuxlseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_inode;
+	loff_t pos;
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = file->f_pos + offset;
+		break;
+	case SEEK_END:
+		pos = inode->i_size + offset;
+		break;
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if ((pos = seek_data_hole(inode, offset, whence == SEEK_HOLE)) < 0)
+			return pos;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (pos < 0)
+		return -EINVAL;
+	tuxseek(file, pos);
+	return pos;
+}
+
+/*
+ * Preallocate unwritten extents, as contiguous as the free space allows.
+ * They read as zeros until the first write of each block.
+ */
+int tuxfallocate(struct inode *inode, loff_t offset, loff_t len, int mode)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (!S_ISREG(inode->i_mode))
+		return -ENODEV;
+	block_t start = offset >> sb->blockbits;
+	block_t limit = (offset + len + sb->blockmask) >> sb->blockbits;
+	if (limit > 1LL << MAX_BLOCKS_BITS)
+		return -EFBIG;
+	int err = orphan_finish(inode);
+	if (err)
+		return err;
+	while (start < limit) {
+		struct seg map[64];
+		unsigned count = min(limit - start, (block_t)MAX_REGION >> sb->blockbits);
+		/* claim a run per chunk, the whole length may not fit an unsigned */
+		set_data_goal(inode, count);
+		int segs = map_region(inode, start, count, map, ARRAY_SIZE(map), 3);
+		if (segs <= 0) {
+			put_data_goal(inode);
+			return segs ? segs : -EIO;
+		}
+		for (int i = 0; i < segs; i++)
+			start += map[i].count;
+	}
+	put_data_goal(inode);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode->i_size)
+		inode->i_size = offset + len;
+	return 0;
+}
+
 void tuxclose(struct inode *inode)
 {
+	orphan_finish(inode);
 	tuxsync(inode);
 	free_inode(inode);
 }
@@ -197,7 +577,9 @@ int main(int argc, char *argv[])
 		error("usage: %s <volname>", argv[0]);
 	int err = 0;
 	char *name = argv[1];
-	fd_t fd = open(name, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+	fd_t fd = diskopen(name, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+	if (fd < 0)
+		error("could not open '%s' (%s)", name, strerror(-fd));
 	ftruncate(fd, 1 << 24);
 	u64 size = 0;
 	if (fdsize64(fd, &size))
@@ -207,7 +589,7 @@ int main(int argc, char *argv[])
 	struct sb *sb = &(struct sb){
 		INIT_SB(dev),
 		.max_inodes_per_block = 64,
-		.entries_per_node = 20,
+		.entries_per_node = bnode_fanout(1 << dev->bits),
 		.volblocks = size >> dev->bits,
 	};
 	sb->volmap = rapid_open_inode(sb, NULL, 0);
@@ -252,6 +634,182 @@ int main(int argc, char *argv[])
 	if (got < 0)
 		exit(1);
 	hexdump(buf, got);
+	trace(">>> large extent io");
+	struct inode *big = tuxcreate(sb->rootdir, "big", 3, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+	file = &(struct file){ .f_inode = big };
+	char *block = malloc(sb->blocksize);
+	for (int i = 0; i < 300; i++) {
+		memset(block, i, sb->blocksize);
+		assert(tuxwrite(file, block, sb->blocksize) == sb->blocksize);
+	}
+	assert(!tuxsync(big));
+	assert(list_empty(&mapping(big)->dirty));
+	evict_buffers(mapping(big));
+	tuxseek(file, 0);
+	for (int i = 0; i < 300; i++) {
+		assert(tuxread(file, block, sb->blocksize) == sb->blocksize);
+		assert(block[0] == (char)i && block[sb->blocksize - 1] == (char)i);
+	}
+	/* the reads left the mapping cached, writing it out drops it */
+	struct seg seg[2];
+	assert(ecache_lookup(big, 10, 5, seg, 2) == 1 && seg[0].count == 5);
+	/* any chop makes it stale, even one that frees nothing */
+	assert(!tree_chop(&big->btree, &(struct delete_info){ .key = 300 }, 0));
+	assert(!ecache_lookup(big, 10, 5, seg, 2));
+	assert(map_region(big, 10, 5, seg, 2, 0) == 1 && ecache_lookup(big, 10, 5, seg, 2) == 1);
+	tuxseek(file, 0);
+	assert(tuxwrite(file, block, sb->blocksize) == sb->blocksize);
+	assert(!tuxsync(big) && !big->ecache);
+	trace(">>> interleaved writers");
+	struct file *one = &(struct file){ .f_inode = tuxcreate(sb->rootdir, "one", 3, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU }) };
+	struct file *two = &(struct file){ .f_inode = tuxcreate(sb->rootdir, "two", 3, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU }) };
+	for (int i = 0; i < 40; i++) {
+		memset(block, i + 1, sb->blocksize);
+		assert(tuxwrite(one, block, sb->blocksize) == sb->blocksize);
+		memset(block, -i - 1, sb->blocksize);
+		assert(tuxwrite(two, block, sb->blocksize) == sb->blocksize);
+	}
+	assert(!tuxsync(one->f_inode) && !tuxsync(two->f_inode));
+	/* delayed allocation keeps each file contiguous */
+	assert(map_region(one->f_inode, 0, 40, seg, 2, 0) == 1 && seg[0].count == 40);
+	assert(map_region(two->f_inode, 0, 40, seg, 2, 0) == 1 && seg[0].count == 40);
+	/* so does background writeback, and metadata cannot take the run meanwhile */
+	struct file *three = &(struct file){ .f_inode = tuxcreate(sb->rootdir, "three", 5, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU }) };
+	for (int i = 0; i < 40; i++)
+		assert(tuxwrite(three, block, sb->blocksize) == sb->blocksize);
+	set_data_goal(three->f_inode, 8);
+	block_t run = three->f_inode->goal, meta;
+	assert(three->f_inode->reserved == 8 && !balloc(sb, 1, &meta) && (meta < run || meta >= run + 8));
+	assert(!bfree(sb, meta, 1));
+	put_data_goal(three->f_inode);
+	set_writeback(0, 0, 0);
+	assert(!balance_dirty_buffers(mapping(three->f_inode)));
+	set_writeback(10, 40, 30);
+	assert(list_empty(&mapping(three->f_inode)->dirty) && !three->f_inode->reserved);
+	assert(map_region(three->f_inode, 0, 40, seg, 2, 0) == 1 && seg[0].count == 40);
+	trace(">>> preallocation");
+	struct file *pre = &(struct file){ .f_inode = tuxcreate(sb->rootdir, "pre", 3, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU }) };
+	assert(!tuxfallocate(pre->f_inode, 0, 100 << sb->blockbits, 0));
+	assert(pre->f_inode->i_size == 100 << sb->blockbits);
+	assert(map_region(pre->f_inode, 0, 100, seg, 2, 0) == 2 && seg[0].state == SEG_UNWRITTEN);
+	assert(seg[1].block == seg[0].block + seg[0].count && seg[1].state == SEG_UNWRITTEN);
+	block_t prealloc = seg[0].block;
+	memset(block, 'p', sb->blocksize);
+	tuxseek(pre, 10 << sb->blockbits);
+	assert(tuxwrite(pre, block, sb->blocksize) == sb->blocksize);
+	assert(!tuxsync(pre->f_inode));
+	evict_buffers(mapping(pre->f_inode));
+	tuxseek(pre, 9 << sb->blockbits);
+	for (int i = 9; i < 12; i++) {
+		assert(tuxread(pre, block, sb->blocksize) == sb->blocksize);
+		assert(block[0] == (i == 10 ? 'p' : 0));
+	}
+	/* the write converted its block in place */
+	struct seg conv[4];
+	assert(map_region(pre->f_inode, 0, 100, conv, 4, 0) == 4);
+	assert(conv[0].state == SEG_UNWRITTEN && conv[0].count == 10);
+	assert(!conv[1].state && conv[1].block == prealloc + 10 && conv[1].count == 1);
+	assert(conv[2].state == SEG_UNWRITTEN && conv[2].block == prealloc + 11);
+	/* unwritten extents are holes to SEEK_DATA and SEEK_HOLE */
+	assert(tuxlseek(pre, 0, SEEK_DATA) == 10 << sb->blockbits);
+	assert(tuxlseek(pre, 10 << sb->blockbits, SEEK_HOLE) == 11 << sb->blockbits);
+	assert(tuxlseek(pre, 11 << sb->blockbits, SEEK_DATA) == -ENXIO);
+	assert(tuxlseek(pre, 0, SEEK_END) == pre->f_inode->i_size);
+	/* unflushed writes are data too, and asking does not flush them */
+	tuxseek(pre, 20 << sb->blockbits);
+	assert(tuxwrite(pre, block, sb->blocksize) == sb->blocksize);
+	tuxseek(pre, 200 << sb->blockbits);
+	assert(tuxwrite(pre, block, sb->blocksize) == sb->blocksize);
+	assert(tuxlseek(pre, 11 << sb->blockbits, SEEK_DATA) == 20 << sb->blockbits);
+	assert(tuxlseek(pre, 101 << sb->blockbits, SEEK_DATA) == 200 << sb->blockbits);
+	assert(tuxmap(pre->f_inode, 20, 1, conv, 4) == 1 && !conv[0].state && conv[0].block == prealloc + 20);
+	assert(tuxmap(pre->f_inode, 199, 2, conv, 4) == 2 && conv[1].state == SEG_DELAYED && conv[1].count == 1);
+	assert(!list_empty(&mapping(pre->f_inode)->dirty) && !tuxsync(pre->f_inode));
+	assert(tuxmap(pre->f_inode, 200, 1, conv, 4) == 1 && !conv[0].state && conv[0].block);
+	free(block);
+	trace(">>> deferred frees");
+	block_t freeblocks = sb->freeblocks, defer[12];
+	for (int i = 0; i < 12; i++)
+		assert(!balloc(sb, 2, &defer[i]));
+	for (int i = 12; i--;)
+		assert(!stash_free(&sb->defree, defer[i], 2));
+	assert(!retire_frees(sb, &sb->defree));
+	assert(sb->freeblocks == freeblocks);
+	assert(balloc_find(sb, defer[0], 2) == defer[0]);
+	empty_stash(&sb->defree);
+	trace(">>> shared hash tree");
+	/* entries added under the leaf latch or by a split are all found again */
+	unsigned char hash[SHA_DIGEST_LENGTH] = { };
+	unsigned hashes = 2 * sb->htree.entries_per_leaf + 1;
+	for (int pass = 0; pass < 2; pass++) {
+		for (unsigned i = 0; i < hashes; i++) {
+			for (int k = 0; k < 8; k++)
+				hash[k] = (i * 0x9e3779b97f4a7c15ULL) >> 8 * k;
+			block_t found = hash_lookup(big, hash);
+			if (pass)
+				assert(found == 5000 + i);
+			else {
+				assert(found == -1);
+				make_hash_entry(big, hash, 5000 + i);
+			}
+		}
+	}
+	/* the last hash was made, then found once: two references */
+	assert(hash_refcount(sb, hash) == 2);
+	hash[SHA_DIGEST_LENGTH - 1] ^= 1;
+	assert(!hash_refcount(sb, hash));
+	trace(">>> deferred truncate and unlink");
+	/* blocks past the new end wait for reclaim_orphans or close */
+	struct inode *gone = tuxcreate(sb->rootdir, "gone", 4, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+	struct file *gfile = &(struct file){ .f_inode = gone };
+	char *fill = malloc(sb->blocksize);
+	for (int i = 0; i < 20; i++) {
+		memset(fill, 'g', sb->blocksize);
+		memcpy(fill, &i, sizeof(i));
+		tuxseek(gfile, (loff_t)2 * i << sb->blockbits);
+		assert(tuxwrite(gfile, fill, sb->blocksize) == sb->blocksize);
+	}
+	assert(!tuxsync(gone));
+	inum_t inum = gone->inum;
+	block_t used = sb->freeblocks;
+	/* growing leaves nothing to chop */
+	assert(!tuxtruncate(gone, 41 << sb->blockbits));
+	assert(!(gone->present & ORPHAN_BIT) && hlist_empty(&sb->orphans));
+	assert(!tuxtruncate(gone, 5 << sb->blockbits));
+	assert(!tuxsync(gone) && sb->freeblocks == used);
+	assert(tux_dir_is_empty(sb->orphandir) == -ENOTEMPTY);
+	/* not chopped yet, but already a hole */
+	assert(map_region(gone, 30, 1, seg, 1, 0) == 1 && seg[0].state == SEG_HOLE);
+	assert(map_region(gone, 4, 4, seg, 2, 0) == 1 && seg[0].count == 1);
+	/* writing past the chop point finishes the chop first */
+	tuxseek(gfile, (loff_t)30 << sb->blockbits);
+	assert(tuxwrite(gfile, fill, sb->blocksize) == sb->blocksize);
+	assert(!tuxsync(gone) && !(gone->present & ORPHAN_BIT));
+	assert(hlist_empty(&sb->orphans) && sb->freeblocks >= used + 16);
+	assert(!tux_dir_is_empty(sb->orphandir));
+	assert(map_region(gone, 30, 1, seg, 1, 0) == 1 && seg[0].state != SEG_HOLE);
+	free(fill);
+	/* a pending chop is listed in the orphan directory for the next mount */
+	assert(!tuxtruncate(gone, 0));
+	free_inode(gone);
+	assert(hlist_empty(&sb->orphans));
+	assert(!load_orphans(sb) && hlist_empty(&sb->orphans));
+	assert(sb->freeblocks >= used + 20);
+	gone = tuxopen(sb->rootdir, "gone", 4);
+	assert(gone && !(gone->present & ORPHAN_BIT));
+	tuxclose(gone);
+	/* unlinked orphans are queued again until reclaimed */
+	assert(!tuxunlink(sb->rootdir, "gone", 4));
+	assert(!hlist_empty(&sb->orphans));
+	free_inode(hlist_entry(sb->orphans.first, struct inode, orphan));
+	assert(hlist_empty(&sb->orphans));
+	assert(!load_orphans(sb) && !hlist_empty(&sb->orphans));
+	assert(!reclaim_orphans(sb, 0));
+	assert(hlist_empty(&sb->orphans) && !tux_dir_is_empty(sb->orphandir));
+	assert(!tuxopen(sb->rootdir, "gone", 4));
+	gone = iget(sb, inum);
+	assert(open_inode(gone));
+	free_inode(gone);
 	trace(">>> show state");
 	show_buffers(mapping(file->f_inode));
 	show_buffers(mapping(sb->rootdir));
@@ -84,47 +84,6 @@ static int all_clear(u8 *bitmap, unsigned start, unsigned count) // untested
 		(!rmask || !(bitmap[roff] & rmask));
 }
 
-static int bytebits(unsigned char c)
-{
-	unsigned count = 0;
-	for (; c; c >>= 1)
-		count += c & 1;
-	return count;
-}
-
-block_t count_range(struct inode *inode, block_t start, block_t count)
-{
-	assert(!(start & 7));
-	unsigned char ones[256];
-	for (int i = 0; i < sizeof(ones); i++)
-		ones[i] = bytebits(i);
-
-	block_t limit = start + count;
-	unsigned blocksize = 1 << tux_sb(inode->i_sb)->blockbits;
-	unsigned mapshift = tux_sb(inode->i_sb)->blockbits + 3;
-	unsigned mapmask = (1 << mapshift) - 1;
-	unsigned blocks = (limit + mapmask) >> mapshift;
-	unsigned offset = (start & mapmask) >> 3;
-	block_t tail = (count + 7) >> 3, total = 0;
-
-	for (unsigned block = start >> mapshift; block < blocks; block++) {
-		//printf("count block %x/%x\n", block, blocks);
-		struct buffer_head *buffer = blockread(mapping(inode), block);
-		if (!buffer)
-			return -1;
-		unsigned bytes = blocksize - offset;
-		if (bytes > tail)
-			bytes = tail;
-		unsigned char *p = bufdata(buffer) + offset, *top = p + bytes;
-		while (p < top)
-			total += ones[*p++];
-		brelse(buffer);
-		tail -= bytes;
-		offset = 0;
-	}
-	return total;
-}
-
 /* userland only */
 block_t bitmap_dump(struct inode *inode, block_t start, block_t count)
 {
@@ -185,84 +144,489 @@ block_t bitmap_dump(struct inode *inode, block_t start, block_t count)
 	return -1;
 }
 
-static block_t balloc_from_range(struct sb *sb, block_t start, unsigned count, unsigned blocks)
+/* Bitmap word holding bit, in bitmap bit order whatever the host */
+static inline u64 bitmap_word(u8 *bitmap, unsigned bit)
+{
+	u64 word;
+	memcpy(&word, bitmap + (bit >> 3), sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
+/*
+ * First run of count zero bits in bits [lo, hi) of one bitmap block, or
+ * -1.  Works a word at a time: bits outside the range read as set, runs
+ * are found with ctz and carried across words.  Bitmap blocks are a
+ * multiple of eight bytes so whole words never overrun the block.
+ */
+static int find_zero_run(u8 *bitmap, unsigned lo, unsigned hi, unsigned count)
+{
+	unsigned run = 0, begin = 0;
+	for (unsigned bit = lo & ~63; bit < hi; bit += 64) {
+		u64 free = ~bitmap_word(bitmap, bit);
+		if (bit < lo)
+			free &= -1ULL << (lo - bit);
+		if (hi - bit < 64)
+			free &= ~(-1ULL << (hi - bit));
+		if (count == 1) {
+			if (free)
+				return bit + __builtin_ctzll(free);
+			continue;
+		}
+		if (free == -1ULL) {
+			if (!run)
+				begin = bit;
+			if ((run += 64) >= count)
+				return begin;
+			continue;
+		}
+		for (unsigned pos = 0; pos < 64;) {
+			u64 rest = free >> pos;
+			if (!rest) {
+				run = 0;
+				break;
+			}
+			unsigned used = __builtin_ctzll(rest);
+			if (used) {
+				run = 0;
+				pos += used;
+				rest >>= used;
+			}
+			unsigned len = ~rest ? __builtin_ctzll(~rest) : 64;
+			if (!run)
+				begin = bit + pos;
+			if ((run += len) >= count)
+				return begin;
+			pos += len;
+		}
+	}
+	return -1;
+}
+
+/* Free blocks and longest free run in the first bits of one bitmap block */
+static unsigned longest_zero_run(u8 *bitmap, unsigned bits, unsigned *total)
+{
+	unsigned run = 0, best = 0;
+	*total = 0;
+	for (unsigned bit = 0; bit < bits; bit += 64) {
+		u64 free = ~bitmap_word(bitmap, bit);
+		if (bits - bit < 64)
+			free &= ~(-1ULL << (bits - bit));
+		*total += __builtin_popcountll(free);
+		for (unsigned pos = 0; pos < 64;) {
+			u64 rest = free >> pos;
+			if (!rest) {
+				run = 0;
+				break;
+			}
+			unsigned used = __builtin_ctzll(rest);
+			if (used) {
+				run = 0;
+				pos += used;
+				rest >>= used;
+			}
+			unsigned len = ~rest ? __builtin_ctzll(~rest) : 64;
+			if ((run += len) > best)
+				best = run;
+			pos += len;
+		}
+	}
+	return best;
+}
+
+/*
+ * Free space summary: free count and longest free run of each bitmap
+ * block, with a max tree over the runs so that a search skips straight
+ * to a bitmap block able to hold the request.  Blocks start unknown,
+ * which reads as an endless run, are summarised the first time a search
+ * reads them and are kept current by every bitmap change after that.
+ *
+ * The volume is split into allocation groups of AGROUP_MAPBITS bitmap
+ * blocks, each a subtree of the summary, with its own lock and goal, so
+ * allocations in different groups do not serialise.  The summary lock
+ * only covers the tree above the groups and the free block count.
+ */
+#define BSUM_UNKNOWN (~0U)
+#define AGROUP_MAPBITS 3 /* log2 bitmap blocks per allocation group */
+
+struct agroup {
+	struct mutex lock;	/* serialises this group's bitmap blocks */
+	block_t goal;		/* where the last allocation here ended */
+};
+
+struct bsum {
+	unsigned mapblocks, leaves;
+	unsigned groupshift, groups; /* bitmap blocks per group, log2 */
+	spinlock_t lock;
+	struct agroup *group;
+	unsigned *free;		/* free blocks per bitmap block */
+	unsigned run[];		/* max tree of longest runs, leaves at the end */
+};
+
+/* Summary for the current volume size, (re)built under the bitmap lock */
+static struct bsum *bsum_get(struct sb *sb)
+{
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapblocks = (sb->volblocks + (1 << mapshift) - 1) >> mapshift;
+	struct bsum *sum = sb->bsum;
+	if (sum && sum->mapblocks == mapblocks)
+		return sum;
+	mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+	if ((sum = sb->bsum) && sum->mapblocks == mapblocks)
+		goto out;
+	free_bsum(sb);
+	if (!mapblocks)
+		goto out;
+	unsigned leaves = 1, groupshift = 0;
+	while (leaves < mapblocks)
+		leaves <<= 1;
+	while (groupshift < AGROUP_MAPBITS && (1 << groupshift) < leaves)
+		groupshift++;
+	unsigned groups = (mapblocks + (1 << groupshift) - 1) >> groupshift;
+	if (!(sum = malloc(sizeof(*sum) + 3 * leaves * sizeof(unsigned))))
+		goto out;
+	if (!(sum->group = malloc(groups * sizeof(*sum->group)))) {
+		free(sum);
+		sum = NULL;
+		goto out;
+	}
+	*sum = (struct bsum){
+		.mapblocks = mapblocks, .leaves = leaves, .group = sum->group,
+		.groupshift = groupshift, .groups = groups };
+	spin_lock_init(&sum->lock);
+	for (unsigned i = 0; i < groups; i++) {
+		mutex_init(&sum->group[i].lock);
+		sum->group[i].goal = (block_t)i << (groupshift + mapshift);
+	}
+	sum->free = sum->run + 2 * leaves;
+	for (unsigned i = 0; i < leaves; i++) {
+		sum->run[leaves + i] = i < mapblocks ? BSUM_UNKNOWN : 0;
+		sum->free[i] = i < mapblocks ? BSUM_UNKNOWN : 0;
+	}
+	for (unsigned i = leaves - 1; i; i--)
+		sum->run[i] = max(sum->run[2 * i], sum->run[2 * i + 1]);
+	sb->bsum = sum;
+out:
+	mutex_unlock(&sb->bitmap->i_mutex);
+	return sum;
+}
+
+void free_bsum(struct sb *sb)
+{
+	if (sb->bsum)
+		free(sb->bsum->group);
+	free(sb->bsum);
+	sb->bsum = NULL;
+}
+
+/*
+ * Resummarise a bitmap block after reading or changing it, and account
+ * the change in free blocks.  The caller holds the lock of its group.
+ */
+static unsigned bsum_update(struct sb *sb, unsigned mapblock, u8 *bitmap, int delta)
+{
+	struct bsum *sum = sb->bsum;
+	if (!sum || mapblock >= sum->mapblocks) {
+		sb->freeblocks += delta;
+		return BSUM_UNKNOWN;
+	}
+	unsigned mapshift = sb->blockbits + 3;
+	block_t bits = sb->volblocks - ((block_t)mapblock << mapshift);
+	if (bits > 1 << mapshift)
+		bits = 1 << mapshift;
+	unsigned run = longest_zero_run(bitmap, bits, &sum->free[mapblock]);
+	unsigned i = sum->leaves + mapblock, top = sum->leaves >> sum->groupshift;
+	for (sum->run[i] = run; i > top; i >>= 1)
+		sum->run[i >> 1] = max(sum->run[i & ~1], sum->run[i | 1]);
+	spin_lock(&sum->lock);
+	for (; i > 1; i >>= 1)
+		sum->run[i >> 1] = max(sum->run[i & ~1], sum->run[i | 1]);
+	sb->freeblocks += delta;
+	spin_unlock(&sum->lock);
+	return run;
+}
+
+/* Longest free run in an allocation group, as far as the summary knows */
+static unsigned group_run(struct bsum *sum, unsigned group)
+{
+	return sum->run[(sum->leaves >> sum->groupshift) + group];
+}
+
+/* Lock serialising changes to the bitmap bits of block */
+static struct mutex *bitmap_lock(struct sb *sb, block_t block)
+{
+	struct bsum *sum = bsum_get(sb);
+	unsigned groupbits = sb->blockbits + 3 + (sum ? sum->groupshift : 0);
+	if (!sum || block >> groupbits >= sum->groups)
+		return &sb->bitmap->i_mutex;
+	return &sum->group[block >> groupbits].lock;
+}
+
+/* First bitmap block from mapblock on that may hold a run of want, or -1 */
+static int bsum_next(struct bsum *sum, unsigned mapblock, unsigned want)
+{
+	unsigned i = sum->leaves + mapblock;
+	if (sum->run[i] >= want)
+		return mapblock;
+	for (; i > 1; i >>= 1) {
+		if (!(i & 1) && sum->run[i + 1] >= want) {
+			for (i++; i < sum->leaves;)
+				i = sum->run[2 * i] >= want ? 2 * i : 2 * i + 1;
+			return i - sum->leaves;
+		}
+	}
+	return -1;
+}
+
+/* Set bits in bytes of bitmap, a word at a time */
+static block_t count_bits(u8 *bitmap, unsigned bytes)
+{
+	block_t total = 0;
+	unsigned i = 0;
+	for (u64 word; i + sizeof(word) <= bytes; i += sizeof(word)) {
+		memcpy(&word, bitmap + i, sizeof(word));
+		total += __builtin_popcountll(word);
+	}
+	for (; i < bytes; i++)
+		total += __builtin_popcount(bitmap[i]);
+	return total;
+}
+
+/*
+ * Count allocated blocks.  Whole bitmap blocks the free space summary
+ * already knows about are not read, see bsum_update.
+ */
+block_t count_range(struct inode *inode, block_t start, block_t count)
+{
+	assert(!(start & 7));
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct bsum *sum = inode == sb->bitmap ? sb->bsum : NULL;
+	block_t limit = start + count;
+	unsigned blocksize = 1 << sb->blockbits;
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapmask = (1 << mapshift) - 1;
+	unsigned blocks = (limit + mapmask) >> mapshift;
+	unsigned offset = (start & mapmask) >> 3;
+	block_t tail = (count + 7) >> 3, total = 0;
+
+	for (unsigned block = start >> mapshift; block < blocks; block++) {
+		//printf("count block %x/%x\n", block, blocks);
+		unsigned bytes = blocksize - offset;
+		if (bytes > tail)
+			bytes = tail;
+		if (bytes == blocksize && sum && block < sum->mapblocks &&
+		    sum->free[block] != BSUM_UNKNOWN &&
+		    ((block_t)(block + 1) << mapshift) <= sb->volblocks) {
+			total += (1 << mapshift) - sum->free[block];
+		} else {
+			struct buffer_head *buffer = blockread(mapping(inode), block);
+			if (!buffer)
+				return -1;
+			total += count_bits(bufdata(buffer) + offset, bytes);
+			brelse(buffer);
+		}
+		tail -= bytes;
+		offset = 0;
+	}
+	return total;
+}
+
+/*
+ * First free run of blocks in range, claimed if asked.  The caller gets
+ * the summary, if any, before taking the bitmap lock, as bsum_get takes
+ * that lock to build it.
+ */
+static block_t find_free_range(struct sb *sb, struct bsum *sum, block_t start, unsigned count, unsigned blocks, int claim)
 {
 	struct inode *inode = sb->bitmap;
 	trace_off("balloc %i blocks from [%Lx/%Lx]", blocks, (L)start, (L)count);
 	assert(blocks > 0);
 	block_t limit = start + count;
-	unsigned blocksize = 1 << sb->blockbits;
 	unsigned mapshift = sb->blockbits + 3;
 	unsigned mapmask = (1 << mapshift) - 1;
 	unsigned mapblocks = (limit + mapmask) >> mapshift;
-	unsigned offset = (start & mapmask) >> 3;
-	unsigned startbit = start & 7;
-	block_t tail = (count + startbit + 7) >> 3;
 	for (unsigned mapblock = start >> mapshift; mapblock < mapblocks; mapblock++) {
+		if (sum && mapblock < sum->mapblocks) {
+			int next = bsum_next(sum, mapblock, blocks);
+			if ((mapblock = next < 0 ? sum->mapblocks : next) >= mapblocks)
+				break;
+		}
 		trace_off("search mapblock %x/%x", mapblock, mapblocks);
+		block_t base = (block_t)mapblock << mapshift;
+		unsigned lo = start > base ? start - base : 0;
+		unsigned hi = limit - base > mapmask ? mapmask + 1 : limit - base;
+		if (hi - lo < blocks)
+			continue;
 		struct buffer_head *buffer = blockread(mapping(inode), mapblock);
 		if (!buffer) {
 			warn("block read failed"); // !!! error return sucks here
 			return -1;
 		}
-		unsigned bytes = blocksize - offset, run = 0;
-		if (bytes > tail)
-			bytes = tail;
-		unsigned char *p = bufdata(buffer) + offset, *top = p + bytes, c;
-		for (; p < top; p++, startbit = 0) {
-			if ((c = *p) == 0xff) {
-				run = 0;
-				continue;
-			}
-			for (int i = startbit, mask = 1 << startbit; i < 8; i++, mask <<= 1) {
-				if ((c & mask)) {
-					run = 0;
-					continue;
-				}
-				if (++run < blocks)
-					continue;
-				assert(run == blocks);
-				block_t found = i + (((void *)p - bufdata(buffer)) << 3) + (mapblock << mapshift);
-				if (found >= limit) {
-					assert(mapblock == mapblocks - 1);
-					goto final_partial_byte;
-				}
-				found -= run - 1;
-				blockdirty(buffer, sb->delta);
-				set_bits(bufdata(buffer), found & mapmask, run);
-				brelse(buffer);
-				sb->nextalloc = found + run;
-				sb->freeblocks -= run;
-				//set_sb_dirty(sb);
-				return found;
-			}
+		if (sum && mapblock < sum->mapblocks && sum->free[mapblock] == BSUM_UNKNOWN &&
+		    bsum_update(sb, mapblock, bufdata(buffer), 0) < blocks) {
+			brelse(buffer);
+			continue;
+		}
+		int found = find_zero_run(bufdata(buffer), lo, hi, blocks);
+		if (found < 0) {
+			brelse(buffer);
+			continue;
+		}
+		if (claim) {
+			blockdirty(buffer, sb->delta);
+			set_bits(bufdata(buffer), found, blocks);
+			bsum_update(sb, mapblock, bufdata(buffer), -blocks);
+			//set_sb_dirty(sb);
 		}
-final_partial_byte:
 		brelse(buffer);
-		tail -= bytes;
-		offset = 0;
+		return base + found;
 	}
 	return -1;
 }
 
-int balloc(struct sb *sb, unsigned blocks, block_t *block)
+static inline block_t balloc_from_range(struct sb *sb, block_t start, unsigned count, unsigned blocks)
+{
+	return find_free_range(sb, bsum_get(sb), start, count, blocks, 1);
+}
+
+/* Search range from goal to its end, then wrap around to goal */
+static block_t find_free_wrap(struct sb *sb, struct bsum *sum, block_t start, block_t limit, block_t goal, unsigned blocks, int claim)
+{
+	block_t found;
+	if (goal < start || goal >= limit)
+		goal = start;
+	if ((found = find_free_range(sb, sum, goal, limit - goal, blocks, claim)) >= 0)
+		return found;
+	return find_free_range(sb, sum, start, goal - start, blocks, claim);
+}
+
+/*
+ * Search the goal's allocation group from the goal on, then each other
+ * group in turn from its own goal, then the goal's group before the goal.
+ * Groups the summary says cannot hold the run are not locked or read.
+ */
+static block_t find_free_goal(struct sb *sb, block_t goal, unsigned blocks, int claim)
+{
+	block_t found, total = sb->volblocks;
+	struct bsum *sum = bsum_get(sb);
+	if (goal >= total)
+		goal = 0;
+	if (!sum) {
+		mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+		found = find_free_wrap(sb, NULL, 0, total, goal, blocks, claim);
+		mutex_unlock(&sb->bitmap->i_mutex);
+		return found;
+	}
+	unsigned groupbits = sb->blockbits + 3 + sum->groupshift;
+	unsigned first = goal >> groupbits;
+	for (unsigned i = 0; i <= sum->groups; i++) {
+		unsigned g = (first + i) % sum->groups;
+		struct agroup *group = sum->group + g;
+		block_t start = (block_t)g << groupbits;
+		block_t limit = min(start + (1 << groupbits), total);
+		if (group_run(sum, g) < blocks)
+			continue;
+		mutex_lock_nested(&group->lock, I_MUTEX_BITMAP);
+		if (!i)
+			found = find_free_range(sb, sum, goal, limit - goal, blocks, claim);
+		else if (i == sum->groups)
+			found = find_free_range(sb, sum, start, goal - start, blocks, claim);
+		else
+			found = find_free_wrap(sb, sum, start, limit, group->goal, blocks, claim);
+		if (found >= 0 && claim)
+			group->goal = found + blocks;
+		mutex_unlock(&group->lock);
+		if (found >= 0)
+			return found;
+	}
+	return -1;
+}
+
+/*
+ * Allocate near goal.  Metadata allocates at the global goal, which
+ * follows every metadata allocation, file data at a goal of its own.
+ */
+int balloc_goal(struct sb *sb, block_t goal, unsigned blocks, block_t *block)
 {
 	assert(blocks > 0);
-	trace_off("balloc %x blocks at goal %Lx", blocks, (L)sb->nextalloc);
-	mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
-	block_t goal = sb->nextalloc, total = sb->volblocks;
-	if ((*block = balloc_from_range(sb, goal, total - goal, blocks)) >= 0)
-		goto found;
-	if ((*block = balloc_from_range(sb, 0, goal, blocks)) >= 0)
-		goto found;
-	mutex_unlock(&sb->bitmap->i_mutex);
-	return -ENOSPC;
-found:
+	trace_off("balloc %x blocks at goal %Lx", blocks, (L)goal);
+	*block = find_free_goal(sb, goal, blocks, 1);
+	if (*block < 0)
+		return -ENOSPC;
 	printf("balloc extent -> [%Lx/%x]\n", (L)*block, blocks);
-	mutex_unlock(&sb->bitmap->i_mutex);
 	return 0;
 }
 
+int balloc(struct sb *sb, unsigned blocks, block_t *block)
+{
+	int err = balloc_goal(sb, sb->nextalloc, blocks, block);
+	/*
+	 * No lock covers nextalloc any more, the group locks are taken and
+	 * dropped inside balloc_goal.  It is only a hint where to look next:
+	 * racing updates cost locality, never correctness.
+	 */
+	if (!err)
+		sb->nextalloc = *block + blocks;
+	return err;
+}
+
+/*
+ * Allocate blocks as at most max_segs extents, for when no single run
+ * will do.  The whole run is tried at goal first, then the longest run
+ * the summary knows of, shorter each time a search fails, each extent
+ * going after the one before.  Returns the number of extents, or on
+ * ENOSPC frees whatever it got.
+ */
+int balloc_extents(struct sb *sb, block_t goal, unsigned blocks, struct seg map[], unsigned max_segs)
+{
+	unsigned want = blocks, segs = 0;
+	assert(blocks > 0);
+	while (blocks) {
+		if (segs == max_segs)
+			goto nospace;
+		unsigned count = min(want, blocks);
+		block_t block = find_free_goal(sb, goal, count, 1);
+		if (block < 0) {
+			struct bsum *sum = sb->bsum;
+			if (count == 1)
+				goto nospace;
+			want = sum ? min(sum->run[1], count - 1) : count / 2;
+			if (!want)
+				goto nospace;
+			continue;
+		}
+		printf("balloc extent -> [%Lx/%x]\n", (L)block, count);
+		map[segs++] = (struct seg){ .block = block, .count = count };
+		blocks -= count;
+		goal = block + count;
+	}
+	return segs;
+nospace:
+	while (segs--)
+		bfree(sb, map[segs].block, map[segs].count);
+	return -ENOSPC;
+}
+
+/* Where a free run of blocks starts, without allocating it, or -1 */
+block_t balloc_find(struct sb *sb, block_t goal, unsigned blocks)
+{
+	return find_free_goal(sb, goal, blocks, 0);
+}
+
+/*
+ * Goal for the data of a file that has none yet: with more than one
+ * allocation group, files are spread over the groups by inode number.
+ */
+block_t group_goal(struct sb *sb, inum_t inum)
+{
+	struct bsum *sum = bsum_get(sb);
+	if (!sum || sum->groups == 1)
+		return sb->nextalloc;
+	return sum->group[inum % sum->groups].goal;
+}
+
 int bfree(struct sb *sb, block_t start, unsigned blocks)
 {
 	assert(blocks > 0);
@@ -270,7 +634,8 @@ int bfree(struct sb *sb, block_t start, unsigned blocks)
 	unsigned mapmask = (1 << mapshift) - 1;
 	unsigned mapblock = start >> mapshift;
 	char *why = "could not read bitmap buffer";
-	mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+	struct mutex *lock = bitmap_lock(sb, start);
+	mutex_lock_nested(lock, I_MUTEX_BITMAP);
 	struct buffer_head *buffer = blockread(mapping(sb->bitmap), mapblock);
 	printf("free <- [%Lx]\n", (L)start);
 	if (!buffer)
@@ -279,32 +644,105 @@ int bfree(struct sb *sb, block_t start, unsigned blocks)
 		goto eeek;
 	blockdirty(buffer, sb->delta);
 	clear_bits(bufdata(buffer), start, blocks);
+	bsum_update(sb, mapblock, bufdata(buffer), blocks);
 	brelse_dirty(buffer);
-	sb->freeblocks += blocks;
 	//set_sb_dirty(sb);
-	mutex_unlock(&sb->bitmap->i_mutex);
+	mutex_unlock(lock);
 	return 0;
 eeek:
 	why = "blocks already free";
 	brelse(buffer);
 eek:
 	warn("extent 0x%Lx %s!\n", (L)start, why);
-	mutex_unlock(&sb->bitmap->i_mutex);
+	mutex_unlock(lock);
 	return -1; // error???
 }
 
+static int seg_compare(const void *a, const void *b)
+{
+	block_t x = ((struct seg *)a)->block, y = ((struct seg *)b)->block;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Free a batch of extents.  They are sorted and adjacent ones merged,
+ * then each bitmap block is read, dirtied and resummarised once for all
+ * the extents in it, under its group lock.  Like bfree, returns -1 if
+ * some extent was already free, having freed the rest.
+ */
+int bfree_extents(struct sb *sb, struct seg map[], unsigned count)
+{
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapmask = (1 << mapshift) - 1;
+	unsigned segs = 0;
+	int err = 0;
+	sort(map, count, sizeof(*map), seg_compare, NULL);
+	for (unsigned i = 0; i < count; i++) {
+		if (segs && map[segs - 1].block + map[segs - 1].count == map[i].block)
+			map[segs - 1].count += map[i].count;
+		else
+			map[segs++] = map[i];
+	}
+	for (unsigned i = 0; i < segs;) {
+		unsigned mapblock = map[i].block >> mapshift, freed = 0;
+		struct mutex *lock = bitmap_lock(sb, map[i].block);
+		mutex_lock_nested(lock, I_MUTEX_BITMAP);
+		struct buffer_head *buffer = blockread(mapping(sb->bitmap), mapblock);
+		if (!buffer) {
+			warn("extent 0x%Lx could not read bitmap buffer!", (L)map[i].block);
+			mutex_unlock(lock);
+			return -1;
+		}
+		for (; i < segs && map[i].block >> mapshift == mapblock; i++) {
+			unsigned start = map[i].block & mapmask;
+			unsigned blocks = min(map[i].count, mapmask + 1 - start);
+			printf("free <- [%Lx/%x]\n", (L)map[i].block, blocks);
+			if (!all_set(bufdata(buffer), start, blocks)) {
+				warn("extent 0x%Lx blocks already free!", (L)map[i].block);
+				err = -1;
+			} else {
+				if (!freed)
+					blockdirty(buffer, sb->delta);
+				clear_bits(bufdata(buffer), start, blocks);
+				freed += blocks;
+			}
+			if (blocks < map[i].count) {
+				/* rest is in the next bitmap block */
+				map[i].block += blocks;
+				map[i].count -= blocks;
+				break;
+			}
+		}
+		if (freed) {
+			bsum_update(sb, mapblock, bufdata(buffer), freed);
+			brelse_dirty(buffer);
+		} else
+			brelse(buffer);
+		mutex_unlock(lock);
+	}
+	return err;
+}
+
 int update_bitmap(struct sb *sb, block_t start, unsigned count, int set)
 {
 	unsigned shift = sb->blockbits + 3, mask = (1 << shift) - 1;
+	struct mutex *lock = bitmap_lock(sb, start);
+	int err = 0;
+	mutex_lock_nested(lock, I_MUTEX_BITMAP);
 	struct buffer_head *buffer = blockread(mapping(sb->bitmap), start >> shift);
-	if (!buffer)
-		return -ENOMEM;
+	if (!buffer) {
+		err = -ENOMEM;
+		goto out;
+	}
 	if (!(set ? all_clear : all_set)(bufdata(buffer), start & mask, count)) {
 		brelse(buffer);
-		return -EINVAL;
+		err = -EINVAL;
+		goto out;
 	}
 	(set ? set_bits : clear_bits)(bufdata(buffer), start & mask, count);
-	sb->freeblocks += set ? count : -count;
+	bsum_update(sb, start >> shift, bufdata(buffer), set ? -count : count);
 	brelse_dirty(buffer);
-	return 0;
+out:
+	mutex_unlock(lock);
+	return err;
 }
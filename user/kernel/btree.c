@@ -15,11 +15,57 @@
 #define trace trace_off
 #endif
 
+/*
+ * Index entries keep key and child block in 48 bits each, as wide as any
+ * of them get: block numbers, inode numbers and file block indexes are all
+ * 48 bits on disk, and hash tree keys are cut to fit.  Twelve bytes per
+ * entry instead of sixteen gives a third more fanout, 340 entries in a 4K
+ * node where there were 255, not twice as many: keys are not prefix or
+ * delta compressed, all entries in every node have the one fixed stride
+ * cursors walk by.  The price is that no key may pass 48 bits, that hash
+ * tree keys collide more often and lean on the collision buckets, and that
+ * each key compare decodes six bytes.
+ */
 struct bnode
 {
-	be_u32 count, unused;
-	struct index_entry { be_u64 key; be_u64 block; } PACKED entries[];
+	be_u32 count;
+	be_u16 magic, unused;
+	struct index_entry { unsigned char key[6], block[6]; } PACKED entries[];
 } PACKED;
+
+#define BNODE_MAGIC 0xb48e
+
+static inline tuxkey_t index_key(struct index_entry *entry)
+{
+	u64 key;
+	decode48(entry->key, &key);
+	return key;
+}
+
+static inline block_t index_block(struct index_entry *entry)
+{
+	u64 block;
+	decode48(entry->block, &block);
+	return block;
+}
+
+static inline void set_index_key(struct index_entry *entry, tuxkey_t key)
+{
+	assert(!(key >> 48));
+	encode48(entry->key, key);
+}
+
+static inline void set_index_block(struct index_entry *entry, block_t block)
+{
+	assert(!(block >> 48));
+	encode48(entry->block, block);
+}
+
+/* How many index entries a node holds at this block size */
+unsigned bnode_fanout(unsigned blocksize)
+{
+	return (blocksize - offsetof(struct bnode, entries)) / sizeof(struct index_entry);
+}
 /*
  * Note that the first key of an index block is never accessed.  This is
  * because for a btree, there is always one more key than nodes in each
@@ -64,7 +110,7 @@ static struct buffer_head *new_node(struct btree *btree)
 {
 	struct buffer_head *buffer = new_block(btree);
 	if (buffer)
-		((struct bnode *)bufdata(buffer))->count = 0;
+		*(struct bnode *)bufdata(buffer) = (struct bnode){ .magic = to_be_u16(BNODE_MAGIC) };
 	return buffer;
 }
 
@@ -179,11 +225,12 @@ static void cursor_check(struct cursor *cursor)
 		if (!cursor->path[i].next)
 			break;
 		struct bnode *node = cursor_node(cursor, i);
+		assert(from_be_u16(node->magic) == BNODE_MAGIC);
 		assert(node->entries < cursor->path[i].next);
 		assert(cursor->path[i].next <= node->entries + bcount(node));
-		assert(from_be_u64((cursor->path[i].next - 1)->key) >= key);
-		block = from_be_u64((cursor->path[i].next - 1)->block);
-		key = from_be_u64((cursor->path[i].next - 1)->key);
+		assert(index_key(cursor->path[i].next - 1) >= key);
+		block = index_block(cursor->path[i].next - 1);
+		key = index_key(cursor->path[i].next - 1);
 	}
 }
 
@@ -199,8 +246,10 @@ struct cursor *alloc_cursor(struct btree *btree, int extra)
 	if (cursor) {
 		cursor->btree = btree;
 		cursor->len = 0;
-#ifdef CURSOR_DEBUG
+		cursor->prefetch = 0;
+		cursor->prefetch_end = -1;
 		cursor->maxlen = maxlevel;
+#ifdef CURSOR_DEBUG
 		for (int i = 0; i < maxlevel; i++) {
 			cursor->path[i].buffer = FREE_BUFFER; /* for debug */
 			cursor->path[i].next = FREE_NEXT; /* for debug */
@@ -218,34 +267,178 @@ void free_cursor(struct cursor *cursor)
 	free(cursor);
 }
 
-int probe(struct btree *btree, tuxkey_t key, struct cursor *cursor)
+/*
+ * Index nodes only change with the btree lock held for write, so a walk
+ * down the tree needs the lock only for read.  Leaf contents may then be
+ * read or edited in place by several tasks at once, each holding the latch
+ * for its leaf, so tasks working on different leaves proceed together.
+ * Anything that changes the index, such as a leaf split, still takes the
+ * lock for write and needs no latch.  Latches are hashed by block from a
+ * small table shared by all btrees on the volume.  Returns the latch, to
+ * unlock with mutex_unlock.
+ */
+struct mutex *latch_leaf(struct cursor *cursor)
 {
-	unsigned i, depth = btree->root.depth;
-	struct buffer_head *buffer = sb_bread(vfs_sb(btree->sb), btree->root.block);
-	if (!buffer)
-		return -EIO;
-	struct bnode *node = bufdata(buffer);
-
-	for (i = 0; i < depth; i++) {
-		struct index_entry *next = node->entries, *top = next + bcount(node);
-		while (++next < top) /* binary search goes here */
-			if (from_be_u64(next->key) > key)
-				break;
-		trace("probe level %i, %ti of %i", i, next - node->entries, bcount(node));
+	struct mutex *latch = cursor->btree->sb->latch + bufindex(cursor_leafbuf(cursor)) % LEAF_LATCHES;
+	mutex_lock(latch);
+	return latch;
+}
+
+/*
+ * Read ahead the leaves to the right of the cursor.  On arriving in a new
+ * index node the whole prefetch window is issued, after that each step
+ * only needs to add the leaf at the far end of the window.
+ */
+static void prefetch_leaves(struct cursor *cursor, int whole)
+{
+	int level = cursor->btree->root.depth - 1;
+	struct bnode *node = cursor_node(cursor, level);
+	struct index_entry *next = cursor->path[level].next, *top = node->entries + bcount(node);
+	unsigned count = cursor->prefetch;
+	if (!whole) {
+		next += count - 1;
+		count = 1;
+	}
+	for (; count-- && next < top && index_key(next) < cursor->prefetch_end; next++)
+		sb_breadahead(vfs_sb(cursor->btree->sb), index_block(next));
+}
+
+/*
+ * First index entry with a key above key, or the end of the node.  The
+ * first key is never looked at, see above.  Branchless binary search:
+ * each step halves the range with a conditional move, so the loop runs
+ * log2(count) times with no mispredicted branches however big the node.
+ */
+static struct index_entry *bnode_seek(struct bnode *node, tuxkey_t key)
+{
+	struct index_entry *base = node->entries + 1;
+	unsigned count = bcount(node);
+	if (count < 2)
+		return base;
+	for (unsigned n = count - 1, half; n > 1; n -= half) {
+		half = n / 2;
+		base = index_key(base + half) <= key ? base + half : base;
+	}
+	return base + (index_key(base) <= key);
+}
+
+/* Whether key still belongs under the entry before next, as bnode_seek would say */
+static int bnode_holds(struct bnode *node, struct index_entry *next, tuxkey_t key)
+{
+	struct index_entry *top = node->entries + bcount(node);
+	if (next - 1 > node->entries && index_key(next - 1) > key)
+		return 0;
+	return next == top || index_key(next) > key;
+}
+
+/* Push the path from buffer, the node at the cursor's level, down to the leaf */
+static int probe_down(struct btree *btree, tuxkey_t key, struct cursor *cursor, struct buffer_head *buffer)
+{
+	unsigned depth = btree->root.depth;
+
+	while (cursor->len < depth) {
+		struct bnode *node = bufdata(buffer);
+		struct index_entry *next = bnode_seek(node, key);
+		trace("probe level %i, %ti of %i", cursor->len, next - node->entries, bcount(node));
 		level_push(cursor, buffer, next);
-		if (!(buffer = sb_bread(vfs_sb(btree->sb), from_be_u64((next - 1)->block))))
+		if (!(buffer = sb_bread(vfs_sb(btree->sb), index_block(next - 1))))
 			goto eek;
-		node = (struct bnode *)bufdata(buffer);
 	}
 	assert((btree->ops->leaf_sniff)(btree, bufdata(buffer)));
 	level_push(cursor, buffer, NULL);
+	cursor->gen = btree->gen;
 	cursor_check(cursor);
+	if (cursor->prefetch && depth)
+		prefetch_leaves(cursor, 1);
 	return 0;
 eek:
 	release_cursor(cursor);
 	return -EIO; /* stupid, it might have been NOMEM */
 }
 
+int probe(struct btree *btree, tuxkey_t key, struct cursor *cursor)
+{
+	struct buffer_head *buffer = sb_bread(vfs_sb(btree->sb), btree->root.block);
+	if (!buffer)
+		return -EIO;
+	return probe_down(btree, key, cursor, buffer);
+}
+
+/*
+ * Probe with a cursor still holding the path of an earlier probe, as
+ * sequential reads do over and over.  While the btree generation has not
+ * moved the held index nodes are current, so the path is kept down to
+ * the level where key leaves it and only the nodes below are read again.
+ * Otherwise this is just probe.  Needs the btree lock as probe does.
+ */
+int reprobe(struct btree *btree, tuxkey_t key, struct cursor *cursor)
+{
+	unsigned i, depth = btree->root.depth;
+	if (!depth || cursor->gen != btree->gen || cursor->len != depth + 1) {
+		release_cursor(cursor);
+		return probe(btree, key, cursor);
+	}
+	for (i = 0; i < depth; i++)
+		if (!bnode_holds(cursor_node(cursor, i), cursor->path[i].next, key))
+			break;
+	if (i == depth) {
+		cursor_check(cursor);
+		if (cursor->prefetch)
+			prefetch_leaves(cursor, 1);
+		return 0;
+	}
+	while (cursor->len > i + 1)
+		level_pop_brelse(cursor);
+	return probe_down(btree, key, cursor, level_pop(cursor));
+}
+
+/*
+ * A btree keeps the cursor of its last read probe, still holding its
+ * path, for the next reader to reprobe from.  A reader takes it for
+ * itself and others racing with it make their own meanwhile.  Only ever
+ * taken and kept under the btree lock, so anything changing the tree
+ * under the write lock may drop it, as tree_chop does before freeing
+ * nodes the path may hold.
+ */
+struct cursor *take_cursor(struct btree *btree, int extra)
+{
+	spin_lock(&btree->cursor_lock);
+	struct cursor *cursor = btree->cursor;
+	btree->cursor = NULL;
+	spin_unlock(&btree->cursor_lock);
+	if (cursor && cursor->maxlen < btree->root.depth + 1 + extra) {
+		release_cursor(cursor);
+		free_cursor(cursor);
+		cursor = NULL;
+	}
+	return cursor ? cursor : alloc_cursor(btree, extra);
+}
+
+void keep_cursor(struct btree *btree, struct cursor *cursor)
+{
+	spin_lock(&btree->cursor_lock);
+	if (!btree->cursor) {
+		btree->cursor = cursor;
+		cursor = NULL;
+	}
+	spin_unlock(&btree->cursor_lock);
+	if (cursor) {
+		release_cursor(cursor);
+		free_cursor(cursor);
+	}
+}
+
+/* With the btree lock held for write, or the btree going away */
+void drop_cursor(struct btree *btree)
+{
+	struct cursor *cursor = btree->cursor;
+	if (cursor) {
+		btree->cursor = NULL;
+		release_cursor(cursor);
+		free_cursor(cursor);
+	}
+}
+
 int advance(struct btree *btree, struct cursor *cursor)
 {
 	int depth = btree->root.depth, level = depth;
@@ -256,8 +449,9 @@ int advance(struct btree *btree, struct cursor *cursor)
 			return 0;
 		level--;
 	} while (level_finished(cursor, level));
+	int descend = level + 1 < depth;
 	while (1) {
-		buffer = sb_bread(vfs_sb(btree->sb), from_be_u64(cursor->path[level].next->block));
+		buffer = sb_bread(vfs_sb(btree->sb), index_block(cursor->path[level].next));
 		if (!buffer)
 			goto eek;
 		cursor->path[level].next++;
@@ -268,6 +462,8 @@ int advance(struct btree *btree, struct cursor *cursor)
 	}
 	level_push(cursor, buffer, NULL);
 	cursor_check(cursor);
+	if (cursor->prefetch)
+		prefetch_leaves(cursor, descend);
 	return 1;
 eek:
 	release_cursor(cursor);
@@ -279,38 +475,65 @@ eek:
  * all the way to the end of the index block, there we find the key that
  * separates the subtree we are in (a leaf) from the next subtree to the right.
  */
-static be_u64 *next_keyp(struct cursor *cursor, int depth)
+static struct index_entry *next_index(struct cursor *cursor, int depth)
 {
 	for (int level = depth; level--;)
 		if (!level_finished(cursor, level))
-			return &cursor->path[level].next->key;
+			return cursor->path[level].next;
 	return NULL;
 }
 
 tuxkey_t next_key(struct cursor *cursor, int depth)
 {
-	be_u64 *keyp = next_keyp(cursor, depth);
-	return keyp ? from_be_u64(*keyp) : -1;
+	struct index_entry *entry = next_index(cursor, depth);
+	return entry ? index_key(entry) : -1;
 }
 // also write this_key!!!
 
-void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count)
+/*
+ * Hand each leaf holding keys in [start, end) to actor in key order, with
+ * the key range the leaf covers, clipped to start below.  Leaves are read
+ * ahead a window at a time from the index node above so a long scan keeps
+ * the device busy instead of waiting on one leaf after another.  A nonzero
+ * return from actor stops the scan and is returned.  Caller excludes tree
+ * changes, as for probe.
+ */
+int btree_scan(struct btree *btree, tuxkey_t start, tuxkey_t end, btree_scan_t *actor, void *data)
 {
-	printf("%i level btree at %Li:\n", btree->root.depth, (L)btree->root.block);
+	int depth = btree->root.depth, err;
 	struct cursor *cursor = alloc_cursor(btree, 0);
 	if (!cursor)
-		error("out of memory");
-	if (probe(btree, start, cursor))
-		error("tell me why!!!");
-	struct buffer_head *buffer;
-	do {
-		buffer = cursor_leafbuf(cursor);
-		assert((btree->ops->leaf_sniff)(btree, bufdata(buffer)));
-		(btree->ops->leaf_dump)(btree, bufdata(buffer));
-		//tuxkey_t *next = pnext_key(cursor, btree->depth);
-		//printf("next key = %Lx:\n", next ? (L)*next : 0);
-	} while (--count && advance(btree, cursor));
+		return -ENOMEM;
+	cursor->prefetch = 16;
+	cursor->prefetch_end = end;
+	if ((err = probe(btree, start, cursor)))
+		goto out;
+	for (tuxkey_t key = start;;) {
+		tuxkey_t limit = next_key(cursor, depth);
+		assert((btree->ops->leaf_sniff)(btree, bufdata(cursor_leafbuf(cursor))));
+		if ((err = actor(btree, bufdata(cursor_leafbuf(cursor)), key, limit, data)) || limit >= end)
+			break;
+		if ((err = advance(btree, cursor)) <= 0)
+			goto out;
+		key = limit;
+	}
+	release_cursor(cursor);
+out:
 	free_cursor(cursor);
+	return err;
+}
+
+static int dump_leaf(struct btree *btree, vleaf *leaf, tuxkey_t key, tuxkey_t limit, void *data)
+{
+	(btree->ops->leaf_dump)(btree, leaf);
+	return !--*(unsigned *)data;
+}
+
+void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count)
+{
+	printf("%i level btree at %Li:\n", btree->root.depth, (L)btree->root.block);
+	if (btree_scan(btree, start, -1, dump_leaf, &count) < 0)
+		error("tell me why!!!");
 }
 
 void show_tree(struct btree *btree)
@@ -325,6 +548,7 @@ static void remove_index(struct cursor *cursor, int level)
 	struct bnode *node = cursor_node(cursor, level);
 	int count = bcount(node), i;
 
+	cursor->btree->gen++;
 	/* stomps the node count (if 0th key holds count) */
 	memmove(cursor->path[level].next - 1, cursor->path[level].next,
 		(char *)&node->entries[count] - (char *)cursor->path[level].next);
@@ -343,11 +567,11 @@ static void remove_index(struct cursor *cursor, int level)
 	 * find the node with the old sep, set it to deleted key
 	 */
 	if (cursor->path[level].next == node->entries && level) {
-		be_u64 sep = (cursor->path[level].next)->key;
+		tuxkey_t sep = index_key(cursor->path[level].next);
 		for (i = level - 1; cursor->path[i].next - 1 == cursor_node(cursor, i)->entries; i--)
 			if (!i)
 				return;
-		(cursor->path[i].next - 1)->key = sep;
+		set_index_key(cursor->path[i].next - 1, sep);
 		mark_buffer_dirty(cursor->path[i].buffer);
 	}
 }
@@ -373,6 +597,12 @@ static void brelse_free(struct btree *btree, struct buffer_head *buffer)
 	set_buffer_empty(buffer); // free it!!! (and need a buffer free state)
 }
 
+/*
+ * Chop everything from info->key up, starting at the leaf info->resume
+ * falls in.  With a deadline, zero for none, stop after the leaf where it
+ * passes, leaving info->resume where to go on.  Returns 1 if stopped
+ * early, 0 if done, or negative error.
+ */
 int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline)
 {
 	int depth = btree->root.depth, level = depth - 1, suspend = 0;
@@ -387,6 +617,8 @@ int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadl
 	memset(prev, 0, sizeof(*prev) * depth);
 
 	down_write(&btree->lock);
+	btree->gen++;
+	drop_cursor(btree);
 	probe(btree, info->resume, cursor);
 	leafbuf = level_pop(cursor);
 
@@ -418,15 +650,18 @@ int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadl
 		leafprev = leafbuf;
 keep_prev_leaf:
 
-		//nanosleep(&(struct timespec){ 0, 50 * 1000000 }, NULL);
-		//printf("time remaining: %Lx\n", deadline - gettime());
-//		if (deadline && gettime() > deadline)
-//			suspend = -1;
+		if (deadline && (int)(millitime() - deadline) >= 0)
+			suspend = -1;
 		if (info->blocks && info->freed >= info->blocks)
 			suspend = -1;
 
 		/* pop and try to merge finished nodes */
 		while (suspend || level_finished(cursor, level)) {
+			/* deepest key in the cursor is the resume address */
+			if (suspend == -1 && !level_finished(cursor, level)) {
+				suspend = 1; /* only set resume once */
+				info->resume = index_key(cursor->path[level].next);
+			}
 			/* try to merge node with prev */
 			if (prev[level]) {
 				assert(level); /* node has no prev */
@@ -449,11 +684,6 @@ keep_prev_leaf:
 			prev[level] = level_pop(cursor);
 keep_prev_node:
 
-			/* deepest key in the cursor is the resume address */
-			if (suspend == -1 && !level_finished(cursor, level)) {
-				suspend = 1; /* only set resume once */
-				info->resume = from_be_u64((cursor->path[level].next)->key);
-			}
 			if (!level) { /* remove depth if possible */
 				while (depth > 1 && bcount(bufdata(prev[0])) == 1) {
 					trace("drop btree level");
@@ -468,7 +698,7 @@ keep_prev_node:
 				//sb->snapmask &= ~snapmask; delete_snapshot_from_disk();
 				//set_sb_dirty(sb);
 				//save_sb(sb);
-				ret = suspend;
+				ret = suspend > 0;
 				goto out;
 			}
 			level--;
@@ -477,7 +707,7 @@ keep_prev_node:
 
 		/* push back down to leaf level */
 		while (level < depth - 1) {
-			struct buffer_head *buffer = sb_bread(vfs_sb(sb), from_be_u64(cursor->path[level++].next++->block));
+			struct buffer_head *buffer = sb_bread(vfs_sb(sb), index_block(cursor->path[level++].next++));
 			if (!buffer) {
 				ret = -EIO;
 				goto out;
@@ -487,7 +717,7 @@ keep_prev_node:
 		}
 		//dirty_buffer_count_check(sb);
 		/* go to next leaf */
-		if (!(leafbuf = sb_bread(vfs_sb(sb), from_be_u64(cursor->path[level].next++->block)))) {
+		if (!(leafbuf = sb_bread(vfs_sb(sb), index_block(cursor->path[level].next++)))) {
 			ret = -EIO;
 			goto out;
 		}
@@ -514,8 +744,8 @@ out:
 static void add_child(struct bnode *node, struct index_entry *p, block_t child, u64 childkey)
 {
 	vecmove(p + 1, p, node->entries + bcount(node) - p);
-	p->block = to_be_u64(child);
-	p->key = to_be_u64(childkey);
+	set_index_block(p, child);
+	set_index_key(p, childkey);
 	node->count = to_be_u32(bcount(node) + 1);
 }
 
@@ -529,6 +759,7 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 	struct btree *btree = cursor->btree;
 	int depth = btree->root.depth;
 	block_t childblock = bufindex(leafbuf);
+	btree->gen++;
 	if (keep)
 		brelse(leafbuf);
 	else {
@@ -555,7 +786,7 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 			goto eek;
 		struct bnode *newnode = bufdata(newbuf);
 		unsigned half = bcount(parent) / 2;
-		u64 newkey = from_be_u64(parent->entries[half].key);
+		u64 newkey = index_key(parent->entries + half);
 		newnode->count = to_be_u32(bcount(parent) - half);
 		memcpy(&newnode->entries[0], &parent->entries[half], bcount(newnode) * sizeof(struct index_entry));
 		parent->count = to_be_u32(half);
@@ -585,9 +816,9 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 	struct bnode *newroot = bufdata(newbuf);
 	int left_node = bufindex(cursor->path[0].buffer) != childblock;
 	newroot->count = to_be_u32(2);
-	newroot->entries[0].block = to_be_u64(btree->root.block);
-	newroot->entries[1].key = to_be_u64(childkey);
-	newroot->entries[1].block = to_be_u64(childblock);
+	set_index_block(newroot->entries, btree->root.block);
+	set_index_key(newroot->entries + 1, childkey);
+	set_index_block(newroot->entries + 1, childblock);
 	btree->root.block = bufindex(newbuf);
 	btree->root.depth++;
 	level_root_add(cursor, newbuf, newroot->entries + 1 + !left_node);
@@ -642,7 +873,9 @@ void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btr
 	btree->sb = sb;
 	btree->ops = ops;
 	btree->root = root;
+	btree->gen++;
 	init_rwsem(&btree->lock);
+	spin_lock_init(&btree->cursor_lock);
 	ops->btree_init(btree);
 }
 
@@ -658,7 +891,7 @@ int new_btree(struct btree *btree, struct sb *sb, struct btree_ops *ops)
 	trace("root at %Lx\n", (L)bufindex(rootbuf));
 	trace("leaf at %Lx\n", (L)bufindex(leafbuf));
 	struct bnode *rootnode = bufdata(rootbuf);
-	rootnode->entries[0].block = to_be_u64(bufindex(leafbuf));
+	set_index_block(rootnode->entries, bufindex(leafbuf));
 	rootnode->count = to_be_u32(1);
 	btree->root = (struct root){ .block = bufindex(rootbuf), .depth = 1 };
 	brelse(rootbuf);
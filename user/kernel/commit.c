@@ -24,8 +24,7 @@ int unpack_sb(struct sb *sb, struct disksuper *super, struct root *iroot, int si
 	sb->blockbits = from_be_u16(super->blockbits);
 	sb->blocksize = 1 << sb->blockbits;
 	sb->blockmask = (1 << sb->blockbits) - 1;
-	/* FIXME: those should be initialized based on blocksize. */
-	sb->entries_per_node = 20;
+	sb->entries_per_node = bnode_fanout(sb->blocksize);
 	sb->max_inodes_per_block = 64;
 //	sb->version;
 	sb->atomref_base = 1 << (40 - sb->blockbits); // see xattr.c
@@ -64,12 +64,18 @@ unsigned hleaf_free(struct btree *btree, vleaf *leaf)
 	return btree->entries_per_leaf - to_hleaf(leaf)->count;
 }
 
+/* First entry with key at least key, by branchless binary search */
 unsigned hleaf_seek(struct btree *btree, tuxkey_t key, struct hleaf *leaf)
 {
-	unsigned at = 0;
-	while (at < leaf->count && leaf->entries[at].key < key)
-		at++;
-	return at;
+	struct hleaf_entry *base = leaf->entries;
+	unsigned n = leaf->count, half;
+	if (!n)
+		return 0;
+	for (; n > 1; n -= half) {
+		half = n / 2;
+		base = base[half].key < key ? base + half : base;
+	}
+	return base - leaf->entries + (base->key < key);
 }
 
 void *hleaf_resize(struct btree *btree, tuxkey_t key, vleaf *data, unsigned one)
@@ -97,13 +103,19 @@ void hleaf_dump(struct btree *btree, vleaf *data)
 	trace(" (%x free)\n", hleaf_free(btree, leaf));
 }
 
+/*
+ * Buckets are shared by every file, and hash tree lookups in different
+ * leaves can reach the same bucket, so all bucket reads and changes and
+ * the bucket pointers of inodes are under sb->bucket_lock.
+ */
 block_t bucket_lookup(struct inode *inode, unsigned char *hash)
 {
 	int k;
 	struct bucket_entry *entry;
-	block_t block;
+	block_t block = -1;
+	mutex_lock(&tux_sb(inode->i_sb)->bucket_lock);
 	if(inode->refbucket == 0)
-		return -1;
+		goto out;
 	trace("In reference bucket %Lx",(L)inode->refbucket);
 	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->refbucket); 
 	struct bucket *bck = (struct bucket *)bufdata(buffer);
@@ -121,18 +133,21 @@ block_t bucket_lookup(struct inode *inode, unsigned char *hash)
 			block = entry->block;
 			trace("Found block %Lx",(L)block);
 			brelse_dirty(buffer);
-			return block;
+			goto out;
 		}
 		
 	}      
 	brelse(buffer);
 	trace("Not found in reference bucket %Lx", (L)inode->refbucket);
-	return -1;
+out:
+	mutex_unlock(&tux_sb(inode->i_sb)->bucket_lock);
+	return block;
 }
 
 void make_hash_entry(struct inode *inode, unsigned char *hash, block_t block)
 {
 	trace("Making hash entry for block %Lx in writebucket %Lx", (L)block, (L)inode->writebucket);
+	mutex_lock(&tux_sb(inode->i_sb)->bucket_lock);
 	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->writebucket);
 	struct bucket *bck = (struct bucket *)bufdata(buffer);
 	struct bucket_entry *entry;
@@ -142,8 +157,10 @@ void make_hash_entry(struct inode *inode, unsigned char *hash, block_t block)
 	memcpy(entry->sha_hash,hash,SHA_DIGEST_LENGTH); 
 	bck->count ++; 
 	brelse_dirty(buffer);
+	mutex_unlock(&tux_sb(inode->i_sb)->bucket_lock);
 }
 
+/* Caller holds bucket_lock */
 void init_writebucket(struct inode *inode)
 {
 	int err = inode->btree.ops->balloc(inode->i_sb, 1, &inode->writebucket);
@@ -159,6 +176,7 @@ void init_writebucket(struct inode *inode)
 	brelse_dirty(buffer);
 }
 
+/* Caller holds bucket_lock */
 block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct hleaf_entry* temp ,unsigned char* hash, int first)
 {
 	if(first == 1){
@@ -256,32 +274,51 @@ block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct
 
 }
 
+/* 48 bits of hash for a key, as much as an index entry holds */
+static u64 hash_key(unsigned char *hash)
+{
+	u64 sh = 0;
+	for (int k = 0; k < 6; k++)
+		sh = sh << 8 | hash[k];
+	return sh;
+}
+
+/*
+ * The hash tree is shared by the whole volume, so lookups and in place
+ * updates run with the btree lock held only for read, latching the leaf.
+ * Only adding a key to a full leaf takes the lock for write, to split it,
+ * and then starts over because the leaf may have changed meanwhile.  The
+ * latch only covers the leaf, the buckets it points into need
+ * bucket_lock, taken inside the latch.
+ */
 block_t htree_lookup(struct inode *inode, struct btree *btree, unsigned char *hash)
 {
-	int k;
+	int k, exclusive = 0;
 	u64 offset;
-	block_t bckno;
-	u64 sh;
-	for(int k=0; k<8; k++) {
-		sh = sh << 8;
-		sh = sh | (hash[k]);
-	}
+	block_t bckno, ret = -1;
+	u64 sh = hash_key(hash);
 	struct cursor *cursor = alloc_cursor(btree,20);
 	if (!cursor)
 		return -ENOMEM;
-	down_write(&btree->lock);
 	tuxkey_t key = sh;
+	struct mutex *latch;
 	unsigned at;
+retry:
+	if (exclusive)
+		down_write(&btree->lock);
+	else
+		down_read(&btree->lock);
 	if (probe(btree, key, cursor))
 		error("probe for %Lx failed", (L)key);
-	
+	latch = exclusive ? NULL : latch_leaf(cursor);
+	mutex_lock(&tux_sb(inode->i_sb)->bucket_lock);
+
 	at = hleaf_seek(btree, key, bufdata(cursor_leafbuf(cursor))); 
 
 	struct hleaf *leaf = (struct hleaf *)bufdata(cursor_leafbuf(cursor));
 	struct hleaf_entry *temp = leaf->entries + at;
 	
 	if(temp->key == sh && temp->offset != -1) {
-		block_t block;
 		offset = temp->offset;
 		bckno = temp->block;
 		struct buffer_head *buffer = sb_bread(inode->i_sb, bckno);
@@ -297,40 +334,39 @@ block_t htree_lookup(struct inode *inode, struct btree *btree, unsigned char *ha
 		trace("64bit match and offset != -1");
 		if (k == 20) {
 			entry->refcount++;
-			block = entry->block;
+			ret = entry->block;
 			inode->refbucket = bckno;
 			trace("Found entry in tree");
 			trace("Changed reference bucket to %Lx", (L)bckno);
 			brelse_dirty(buffer);
-			release_cursor(cursor);
-			free(cursor);
-			up_write(&btree->lock);
 			trace("64bit match and offset != -1 and now complete 160bit match found");
-			return block;
+			goto out;
 		} else {
 			if(!handle_collision(inode, entry, temp, hash, 1)){
 				brelse(buffer);
 				mark_buffer_dirty(cursor_leafbuf(cursor));
-				release_cursor(cursor);
-				free_cursor(cursor);
-				up_write(&btree->lock);
-				return -1;
+				goto out;
 			}
 		}
 			
 	     	
 	}	
 	else if (temp->key == sh && temp->offset == -1) {
-		block_t coll;
-		coll = handle_collision(inode, NULL, temp, hash, 0);
+		ret = handle_collision(inode, NULL, temp, hash, 0);
 		mark_buffer_dirty(cursor_leafbuf(cursor));
-		release_cursor(cursor);
-		free_cursor(cursor);
-		up_write(&btree->lock);
-		return coll;	
+		goto out;
 	}    
 	trace("Entry not found in tree");
-	struct hleaf_entry *entry = (struct hleaf_entry *)tree_expand(btree, key, 1, cursor);
+	struct hleaf_entry *entry = exclusive ? tree_expand(btree, key, 1, cursor) : hleaf_resize(btree, key, leaf, 1);
+	if (!entry) {
+		assert(!exclusive);
+		mutex_unlock(&tux_sb(inode->i_sb)->bucket_lock);
+		mutex_unlock(latch);
+		release_cursor(cursor);
+		up_read(&btree->lock);
+		exclusive = 1;
+		goto retry;
+	}
 	if(inode->writebucket == 0)
 		init_writebucket(inode);
 	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->writebucket);
@@ -349,10 +385,17 @@ block_t htree_lookup(struct inode *inode, struct btree *btree, unsigned char *ha
 	if (flag != 1)
 		brelse(buffer);
 	mark_buffer_dirty(cursor_leafbuf(cursor));
+out:
+	mutex_unlock(&tux_sb(inode->i_sb)->bucket_lock);
+	if (latch)
+		mutex_unlock(latch);
 	release_cursor(cursor);
+	if (exclusive)
+		up_write(&btree->lock);
+	else
+		up_read(&btree->lock);
 	free_cursor(cursor);
-	up_write(&btree->lock);
-	return -1; 
+	return ret; 
 }
 
 /* ALGORITHM FOR DEDUPLICATION */
@@ -388,3 +431,61 @@ struct btree_ops htree_ops = {
 	.leaf_free = hleaf_free,
 	.balloc = balloc,
 };
+
+/*
+ * How many mappings share the block holding data of this hash, zero if
+ * the hash is not in the table.  Only looks, takes no reference.
+ */
+int hash_refcount(struct sb *sb, unsigned char *hash)
+{
+	struct btree *btree = &sb->htree;
+	tuxkey_t key = hash_key(hash);
+	int refcount = 0;
+	if (!btree->root.depth)
+		return 0;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	if (!cursor)
+		return -ENOMEM;
+	down_read(&btree->lock);
+	if ((refcount = probe(btree, key, cursor)))
+		goto out;
+	struct mutex *latch = latch_leaf(cursor);
+	mutex_lock(&sb->bucket_lock);
+	struct hleaf *leaf = bufdata(cursor_leafbuf(cursor));
+	unsigned at = hleaf_seek(btree, key, leaf);
+	if (at == leaf->count || leaf->entries[at].key != key)
+		goto unlock;
+	block_t bckno = leaf->entries[at].block;
+	int offset = leaf->entries[at].offset;
+	struct buffer_head *buffer;
+	struct bucket *bck;
+	if (offset == -1) {
+		/* collision bucket entries give bucket and offset of the real entry */
+		if (!(buffer = sb_bread(sb, bckno)))
+			goto unlock;
+		bck = bufdata(buffer);
+		for (int i = 0; i < bck->count; i++)
+			if (!memcmp(bck->entries[i].sha_hash, hash, SHA_DIGEST_LENGTH)) {
+				bckno = bck->entries[i].block;
+				offset = bck->entries[i].refcount;
+				break;
+			}
+		brelse(buffer);
+		if (offset == -1)
+			goto unlock;
+	}
+	if (!(buffer = sb_bread(sb, bckno)))
+		goto unlock;
+	bck = bufdata(buffer);
+	if (!memcmp(bck->entries[offset].sha_hash, hash, SHA_DIGEST_LENGTH))
+		refcount = bck->entries[offset].refcount;
+	brelse(buffer);
+unlock:
+	mutex_unlock(&sb->bucket_lock);
+	mutex_unlock(latch);
+	release_cursor(cursor);
+out:
+	up_read(&btree->lock);
+	free_cursor(cursor);
+	return refcount;
+}
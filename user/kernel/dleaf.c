@@ -424,6 +424,11 @@ unsigned dwalk_count(struct dwalk *walk)
 	return extent_count(*walk->extent);
 }
 
+int dwalk_unwritten(struct dwalk *walk)
+{
+	return extent_unwritten(*walk->extent);
+}
+
 /* unused */
 void dwalk_dump(struct dwalk *walk)
 {
@@ -763,6 +768,19 @@ static void dwalk_update(struct dwalk *walk, struct diskextent extent)
 	*walk->extent = extent;
 }
 
+/* Free the extents a chop collected, as one batch if the btree can */
+static void chop_free(struct btree *btree, struct seg map[], unsigned count)
+{
+	/* FIXME: err check? */
+	if (btree->ops->bfree_extents) {
+		if (count)
+			(btree->ops->bfree_extents)(btree->sb, map, count);
+		return;
+	}
+	for (unsigned i = 0; i < count; i++)
+		(btree->ops->bfree)(btree->sb, map[i].block, map[i].count);
+}
+
 /*
  * Reasons this dleaf truncator sucks:
  *
@@ -785,28 +803,32 @@ static int dleaf_chop(struct btree *btree, tuxkey_t chop, vleaf *vleaf)
 	struct sb *sb = btree->sb;
 	struct dleaf *leaf = to_dleaf(vleaf);
 	struct dwalk walk;
+	struct seg *map;
+	unsigned count = 0;
 
 	if (!dwalk_probe(leaf, sb->blocksize, &walk, chop))
 		return 0;
+	if (!(map = malloc(sb->blocksize / sizeof(struct diskextent) * sizeof(*map))))
+		return -ENOMEM;
 
 	/* Chop this extent partially */
 	if (dwalk_index(&walk) < chop) {
 		block_t block = dwalk_block(&walk);
-		unsigned count = chop - dwalk_index(&walk);
+		unsigned keep = chop - dwalk_index(&walk);
 
-		/* FIXME: err check? */
-		(btree->ops->bfree)(sb, block + count, dwalk_count(&walk) - count);
-		dwalk_update(&walk, make_extent(block, count));
+		map[count++] = (struct seg){ block + keep, dwalk_count(&walk) - keep };
+		dwalk_update(&walk, make_extent_version(block, keep, extent_version(*walk.extent)));
 		if (!dwalk_next(&walk))
 			goto out;
 	}
 	struct dwalk rewind = walk;
 	do {
-		/* FIXME: err check? */
-		(btree->ops->bfree)(sb, dwalk_block(&walk), dwalk_count(&walk));
+		map[count++] = (struct seg){ dwalk_block(&walk), dwalk_count(&walk) };
 	} while (dwalk_next(&walk));
 	dwalk_chop(&rewind);
 out:
+	chop_free(btree, map, count);
+	free(map);
 	assert(!dleaf_check(leaf, sb->blocksize));
 	return 1;
 }
@@ -824,4 +846,5 @@ struct btree_ops dtree_ops = {
 	.leaf_merge = dleaf_merge,
 	.balloc = balloc,
 	.bfree = bfree,
+	.bfree_extents = bfree_extents,
 };
@@ -16,12 +16,6 @@
 #define trace trace_off
 #endif
 
-#define SEG_HOLE	(1 << 0)
-#define SEG_NEW		(1 << 1)
-#define SEG_DUP         (1 << 2)
-
-struct seg { block_t block; unsigned count; unsigned state; };
-
 /* userland only */
 void show_segs(struct seg map[], unsigned segs)
 {
@@ -31,6 +25,174 @@ void show_segs(struct seg map[], unsigned segs)
 	printf("\n");
 }
 
+/*
+ * Extent cache
+ *
+ * Recently mapped regions of a file, holes included, kept as a sorted
+ * array of disjoint segs so reads of a region already mapped need no
+ * btree probe.  Filled by map_region reads under the btree read lock, so
+ * several readers may fill at once, hence ecache_lock.  The cache holds
+ * the btree generation it was filled at, and any chop or index change
+ * bumps that, so a stale cache is never used whoever changed the tree.
+ * Create changes leaves without bumping it and drops the cache itself.
+ * When full it starts over.
+ */
+#define ECACHE_MAX 256
+
+struct ecache {
+	unsigned count, gen;
+	struct ecache_seg { block_t index; struct seg seg; } map[ECACHE_MAX];
+};
+
+/* Index of the first cached seg ending after index */
+static unsigned ecache_find(struct ecache *ecache, block_t index)
+{
+	unsigned lo = 0, hi = ecache->count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		struct ecache_seg *entry = ecache->map + mid;
+		if (entry->index + entry->seg.count <= index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Map as much of the region as is cached without a gap from its start */
+static int ecache_lookup(struct inode *inode, block_t start, unsigned count, struct seg map[], unsigned max_segs)
+{
+	struct ecache *ecache = tux_inode(inode)->ecache;
+	block_t index = start, limit = start + count;
+	int segs = 0;
+	spin_lock(&tux_inode(inode)->ecache_lock);
+	if (!ecache || ecache->gen != tux_inode(inode)->btree.gen)
+		goto out;
+	for (unsigned i = ecache_find(ecache, start); i < ecache->count && segs < max_segs && index < limit; i++) {
+		struct ecache_seg *entry = ecache->map + i;
+		if (entry->index > index)
+			break;
+		unsigned skip = index - entry->index;
+		struct seg seg = entry->seg;
+		if (!(seg.state & SEG_HOLE))
+			seg.block += skip;
+		seg.count = min(seg.count - skip, (unsigned)(limit - index));
+		map[segs++] = seg;
+		index += seg.count;
+	}
+out:
+	spin_unlock(&tux_inode(inode)->ecache_lock);
+	trace("cached %i segs for %Lx/%x", segs, (L)start, count);
+	return segs;
+}
+
+static void ecache_fill(struct inode *inode, block_t start, struct seg map[], int segs)
+{
+	struct ecache *ecache = tux_inode(inode)->ecache, *new = NULL;
+	unsigned gen = tux_inode(inode)->btree.gen;
+	if (segs > ECACHE_MAX)
+		return;
+	if (!ecache && !(new = malloc(sizeof(*ecache))))
+		return;
+	spin_lock(&tux_inode(inode)->ecache_lock);
+	if (!(ecache = tux_inode(inode)->ecache)) {
+		ecache = tux_inode(inode)->ecache = new;
+		new = NULL;
+		ecache->count = 0;
+	}
+	if (ecache->gen != gen) {
+		ecache->count = 0;
+		ecache->gen = gen;
+	}
+	block_t end = start;
+	for (int i = 0; i < segs; i++)
+		end += map[i].count;
+	/* cached segs overlapping the region are replaced whole */
+	unsigned lo = ecache_find(ecache, start), hi = ecache_find(ecache, end);
+	if (hi < ecache->count && ecache->map[hi].index < end)
+		hi++;
+	if (ecache->count - (hi - lo) + segs > ECACHE_MAX)
+		lo = hi = ecache->count = 0;
+	memmove(ecache->map + lo + segs, ecache->map + hi, (ecache->count - hi) * sizeof(*ecache->map));
+	ecache->count += segs - (hi - lo);
+	for (int i = 0; i < segs; i++) {
+		ecache->map[lo + i] = (struct ecache_seg){ .index = start, .seg = map[i] };
+		start += map[i].count;
+	}
+	spin_unlock(&tux_inode(inode)->ecache_lock);
+	if (new)
+		free(new);
+}
+
+/* Forget cached mappings, for create and when the inode goes away */
+void invalidate_extents(struct inode *inode)
+{
+	spin_lock(&tux_inode(inode)->ecache_lock);
+	struct ecache *ecache = tux_inode(inode)->ecache;
+	tux_inode(inode)->ecache = NULL;
+	spin_unlock(&tux_inode(inode)->ecache_lock);
+	if (ecache)
+		free(ecache);
+}
+
+/*
+ * Delayed allocation: file data gets no blocks until writeback, which
+ * allocates in ascending order of file block.  Writeback first claims a
+ * free run big enough for all the blocks it is about to write, so they
+ * land contiguously, close to where the file left off, and metadata
+ * allocated meanwhile cannot take the run.  Dirty blocks already mapped
+ * make the run bigger than needed, what is left unused is given back
+ * when writeback is done.  A file with no goal yet starts in the
+ * allocation group its inode number picks, see group_goal.
+ */
+static block_t data_goal(struct inode *inode)
+{
+	block_t goal = tux_inode(inode)->goal;
+	return goal ? goal : group_goal(tux_sb(inode->i_sb), tux_inode(inode)->inum);
+}
+
+/* Give back what writeback claimed and did not use */
+void put_data_goal(struct inode *inode)
+{
+	unsigned reserved = tux_inode(inode)->reserved;
+	if (reserved) {
+		tux_inode(inode)->reserved = 0;
+		bfree(tux_sb(inode->i_sb), tux_inode(inode)->goal, reserved);
+	}
+}
+
+void set_data_goal(struct inode *inode, unsigned blocks)
+{
+	block_t block;
+	put_data_goal(inode);
+	if (!balloc_goal(tux_sb(inode->i_sb), data_goal(inode), blocks, &block)) {
+		tux_inode(inode)->goal = block;
+		tux_inode(inode)->reserved = blocks;
+	}
+}
+
+/* Allocate file data from the claimed run first, then near its end */
+static int balloc_data(struct inode *inode, unsigned blocks, struct seg map[], unsigned max_segs)
+{
+	tuxnode_t *tuxnode = tux_inode(inode);
+	unsigned count = min(tuxnode->reserved, blocks);
+	if (count < blocks && max_segs < 2)
+		count = 0;
+	if (count) {
+		map[0] = (struct seg){ .block = tuxnode->goal, .count = count };
+		tuxnode->goal += count;
+		tuxnode->reserved -= count;
+		if (count == blocks)
+			return 1;
+	}
+	int segs = balloc_extents(tux_sb(inode->i_sb), data_goal(inode), blocks - count, map + !!count, max_segs - !!count);
+	if (segs < 0 && count) {
+		tuxnode->goal -= count;
+		tuxnode->reserved += count;
+	}
+	return segs < 0 ? segs : segs + !!count;
+}
+
 static int map_region(struct inode *inode, block_t start, unsigned count, struct seg map[], unsigned max_segs, int create)
 {
 	struct sb *sb = tux_sb(inode->i_sb);
@@ -42,22 +204,43 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	if (!btree->root.depth)
 		goto out;
 
-	struct cursor *cursor = alloc_cursor(btree, 1); /* allows for depth increase */
+	/* Blocks a pending truncate has yet to chop read as a hole */
+	if (!create && (tux_inode(inode)->present & ORPHAN_BIT)) {
+		block_t chop = tux_inode(inode)->chop.key;
+		if (start >= chop) {
+			map[segs++] = (struct seg){ .count = count, .state = SEG_HOLE };
+			goto out;
+		}
+		if (count > chop - start)
+			count = chop - start;
+	}
+
+	if (!create) {
+		down_read_nested(&btree->lock, inode == sb->bitmap);
+		segs = ecache_lookup(inode, start, count, map, max_segs);
+		up_read(&btree->lock);
+		if (segs)
+			goto out;
+	}
+
+	/* reads probe from where the last read left off, see reprobe */
+	struct cursor *cursor = create ? alloc_cursor(btree, 1) : take_cursor(btree, 1); /* allows for depth increase */
 	if (!cursor) {
 		segs = -ENOMEM;
 		goto out;
 	}
 
-	if (create)
+	if (create) {
 		down_write_nested(&cursor->btree->lock, inode == sb->bitmap);
-	else
+		invalidate_extents(inode);
+	} else
 		down_read_nested(&cursor->btree->lock, inode == sb->bitmap);
 
 	block_t limit = start + count;
 	trace("--- index %Lx, limit %Lx ---", (L)start, (L)limit);
 	int err;
 
-	if ((err = probe(btree, start, cursor))) {
+	if ((err = create ? probe(btree, start, cursor) : reprobe(btree, start, cursor))) {
 		segs = err;
 		goto out_unlock;
 	}
@@ -93,7 +276,8 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 			block = dwalk_block(walk);
 			count = dwalk_count(walk);
 			trace("emit %Lx/%x", (L)block, count );
-			map[segs++] = (struct seg){ .block = block, .count = count };
+			map[segs++] = (struct seg){ .block = block, .count = count,
+				.state = dwalk_unwritten(walk) ? SEG_UNWRITTEN : 0 };
 			index = ex_index + count;
 			dwalk_next(walk);
  		}
@@ -104,8 +288,12 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	map[0].count -= below;
 	map[segs - 1].count -= above;
 
-	if (!create)
-		goto out_release;
+	if (!create) {
+		ecache_fill(inode, start, map, segs);
+		keep_cursor(btree, cursor);
+		up_read(&btree->lock);
+		goto out;
+	}
 
 	struct dleaf *tail = NULL;
 	tuxkey_t tailkey = 0; // probably can just use limit instead
@@ -121,6 +309,10 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	block_t below_block, above_block;
 	below_block = map[0].block - below;
 	above_block = map[segs - 1].block + map[segs - 1].count;
+	unsigned below_version = map[0].state & SEG_UNWRITTEN ? EXTENT_UNWRITTEN : 0;
+	unsigned above_version = map[segs - 1].state & SEG_UNWRITTEN ? EXTENT_UNWRITTEN : 0;
+	/* preallocation has no data to dedup */
+	int dedup = create != 3 && inode->inum > 4 && inode->inum != 10 && inode->inum != 13;
 	if (create == 2) {
 		count = 0;
 		for (int i = 0; i < segs; i++) {
@@ -137,7 +329,7 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	struct buffer_head *buffer;
 	for (int i = 0; i < segs; i++) {
 		if (map[i].state == SEG_HOLE) {
-			if( inode->inum > 4 && inode->inum != 10 && inode->inum != 13) {
+			if (dedup) {
 				buffer = (blockget(mapping(inode),start)); /* DREAMZ */
 				hash = (unsigned char *)malloc(sizeof(unsigned char) * SHA_DIGEST_LENGTH);
 				hash = SHA1(bufdata(buffer),inode->i_sb->blocksize,hash); 
@@ -145,8 +337,18 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 				blk = hash_lookup(inode, hash);
 			}
 			if(blk == -1){
-				count = map[i].count;
-				if ((err = balloc(sb, count, &block))) { // goal ???
+				/*
+				 * Fill the hole with as few extents as free space
+				 * allows, the segs after it moved to the end of the
+				 * map meanwhile to leave room.
+				 */
+				unsigned room = max_segs - segs + 1, rest = segs - i - 1;
+				memmove(map + i + room, map + i + 1, rest * sizeof(*map));
+				if (S_ISREG(inode->i_mode))
+					err = balloc_data(inode, map[i].count, map + i, room);
+				else
+					err = balloc_extents(sb, sb->nextalloc, map[i].count, map + i, room);
+				if (err < 0) {
 					/*
 					 * Out of space on file data allocation.  It happens.  Tread
 					 * carefully.  We have not stored anything in the btree yet,
@@ -164,33 +366,44 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 					segs = err;
 					goto out_create;
 				}
-				if(inode->inum > 4 && inode->inum != 13 && inode->inum != 10){
-					make_hash_entry(inode, hash, block);
+				memmove(map + i + err, map + i + room, rest * sizeof(*map));
+				segs += err - 1;
+				if (dedup) {
+					make_hash_entry(inode, hash, map[i].block);
 					free(hash);
 				}
-				trace("fill in %Lx/%i ", (L)block, count);
-				map[i] = (struct seg){
-					.block = block,
-					.count = count,
+				for (int last = i + err - 1;; i++) {
+					trace("fill in %Lx/%i ", (L)map[i].block, map[i].count);
 					/* if create == 2, buffer should be dirty */
-					.state = create == 2 ? 0 : SEG_NEW,				
-				};
-			
+					map[i].state = create == 2 ? 0 : create == 3 ? SEG_NEW | SEG_UNWRITTEN : SEG_NEW;
+					if (i == last)
+						break;
+				}
+				block = map[i].block + map[i].count;
+				if (S_ISREG(inode->i_mode)) {
+					if (!tux_inode(inode)->reserved)
+						tux_inode(inode)->goal = block;
+				} else
+					sb->nextalloc = block;
 			}
 			else{
-				if(inode->inum > 4 && inode->inum != 13 && inode->inum != 10)
+				if (dedup)
 					free(hash);
 				trace("Duplicate found");
 				map[i] = (struct seg){ .block = blk, .count = count, .state = SEG_DUP, };
 		        }
 			
 			
-		}
+		} else if (create != 3)
+			map[i].state &= ~SEG_UNWRITTEN; /* about to be written */
 	}
-	/* Go back to region start and pack in new segs */
+	/*
+	 * Go back to region start and pack in new segs.  A seg may be longer
+	 * than an extent can say, so it is packed as several extents.
+	 */
 	dwalk_chop(&headwalk);
 	index = start;
-	for (int i = -!!below; i < segs + !!above; i++) {
+	for (int i = -!!below, done = 0; i < segs + !!above; i++) {
 		if (dleaf_free(btree, leaf) < 16) {
 			mark_buffer_dirty(cursor_leafbuf(cursor));
 			struct buffer_head *newbuf = new_leaf(btree);
@@ -210,19 +423,25 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 		}
 		if (i < 0) {
 			trace("emit below");
-			dwalk_add(&headwalk, seg_start, make_extent(below_block, below));
+			dwalk_add(&headwalk, seg_start, make_extent_version(below_block, below, below_version));
 			continue;
 		}
 		if (i == segs) {
 			trace("emit above");
-			dwalk_add(&headwalk, index, make_extent(above_block, above));
+			dwalk_add(&headwalk, index, make_extent_version(above_block, above, above_version));
 			continue;
 		}
-		trace("pack 0x%Lx => %Lx/%x", (L)index, (L)map[i].block, map[i].count);
+		unsigned chunk = min(map[i].count - done, (unsigned)MAX_EXTENT);
+		trace("pack 0x%Lx => %Lx/%x", (L)index, (L)map[i].block + done, chunk);
 		//dleaf_dump(btree, leaf);
-		dwalk_add(&headwalk, index, make_extent(map[i].block, map[i].count));
+		unsigned version = map[i].state & SEG_UNWRITTEN ? EXTENT_UNWRITTEN : 0;
+		dwalk_add(&headwalk, index, make_extent_version(map[i].block + done, chunk, version));
 		//dleaf_dump(btree, leaf);
-		index += map[i].count;
+		index += chunk;
+		if ((done += chunk) < map[i].count)
+			i--;
+		else
+			done = 0;
 	}
 	if (tail) {
 		if (dleaf_need(btree, tail) < dleaf_free(btree, leaf))
@@ -248,7 +467,6 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 out_create:
 	if (tail)
 		free(tail);
-out_release:
 	release_cursor(cursor);
 out_unlock:
 	if (create)
@@ -290,7 +508,7 @@ int tux3_get_block(struct inode *inode, sector_t iblock,
 		set_buffer_new(bh_result);
 		inode->i_blocks += blocks << (sb->blockbits - 9);
 	}
-	if (seg.state != SEG_HOLE) {
+	if (!(seg.state & (SEG_HOLE | SEG_UNWRITTEN))) {
 		map_bh(bh_result, inode->i_sb, seg.block);
 		bh_result->b_size = blocks << sb->blockbits;
 	}
@@ -18,6 +18,7 @@
  */
 
 unsigned atsize[MAX_ATTRS] = {
+	[ORPHAN_ATTR] = 6,
 	[MODE_OWNER_ATTR] = 12,
 	[CTIME_SIZE_ATTR] = 14,
 	[DATA_BTREE_ATTR] = 8,
@@ -54,6 +55,24 @@ int attr_check(void *attrs, unsigned size)
 	return 1;
 }
 
+/* Whether attrs hold an attribute of this kind for the mounted version */
+int has_attr(struct sb *sb, void *attrs, unsigned size, unsigned kind)
+{
+	void *limit = attrs + size;
+	unsigned head, bytes;
+	while (attrs < limit - 1) {
+		attrs = decode16(attrs, &head);
+		if (head >> 12 == kind && (head & 0xfff) == sb->version)
+			return 1;
+		if (head >> 12 == XATTR_ATTR) {
+			decode16(attrs, &bytes);
+			attrs += 2 + bytes;
+		} else
+			attrs += atsize[head >> 12];
+	}
+	return 0;
+}
+
 void dump_attrs(struct inode *inode)
 {
 	//printf("present = %x\n", inode->present);
@@ -77,6 +96,9 @@ void dump_attrs(struct inode *inode)
 		case DATA_BTREE_ATTR:
 			printf("root %Lx:%u ", (L)tuxnode->btree.root.block, tuxnode->btree.root.depth);
 			break;
+		case ORPHAN_ATTR:
+			printf("chop %Lx ", (L)tuxnode->chop.key);
+			break;
 		case XATTR_ATTR:
 			printf("xattr(s) ");
 			break;
@@ -118,6 +140,9 @@ void *encode_attrs(struct inode *inode, void *attrs, unsigned size)
 		case DATA_BTREE_ATTR:
 			attrs = encode64(attrs, pack_root(&tuxnode->btree.root));
 			break;
+		case ORPHAN_ATTR:
+			attrs = encode48(attrs, tuxnode->chop.key);
+			break;
 		}
 	}
 	return attrs;
@@ -165,6 +190,10 @@ void *decode_attrs(struct inode *inode, void *attrs, unsigned size)
 			attrs = decode64(attrs, &v64);
 			init_btree(&tuxnode->btree, sb, unpack_root(v64), &dtree_ops);
 			break;
+		case ORPHAN_ATTR:
+			attrs = decode48(attrs, &v64);
+			tuxnode->chop = (struct delete_info){ .key = v64 };
+			break;
 		case XATTR_ATTR:;
 			// immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
 			unsigned bytes, atom;
@@ -337,6 +337,8 @@ void tux3_clear_inode(struct inode *inode)
 {
 	if (tux_inode(inode)->xcache)
 		kfree(tux_inode(inode)->xcache);
+	invalidate_extents(inode);
+	drop_cursor(&tux_inode(inode)->btree);
 }
 
 int tux3_write_inode(struct inode *inode, int do_sync)
@@ -128,19 +128,45 @@ int stash_free(struct stash *stash, block_t block, unsigned count)
 	return stash_value(stash, ((u64)count << 48) + block);
 }
 
-int retire_frees(struct sb *sb, struct stash *stash)
+/* Stashed extents of each page in turn, oldest first */
+static unsigned stash_segs(struct stash *stash, struct seg *map)
 {
-	while (1) {
-		int err;
-		struct page *page = link_entry(stash->tail->next, struct page, private);
+	struct link *link = stash->tail;
+	unsigned count = 0;
+	do {
+		link = link->next;
+		struct page *page = link_entry(link, struct page, private);
 		u64 *vec = page_address(page), *top = page_address(page) + PAGE_SIZE;
 		if (top == stash->top)
 			top = stash->pos;
-		for (; vec < top; vec++)
-			if ((err = bfree(sb, *vec & ~(-1ULL << 48), *vec >> 48)))
-				return err;
-		if (stash->tail == stash->tail->next)
-			break;
+		for (; vec < top; vec++, count++)
+			if (map)
+				map[count] = (struct seg){ *vec & ~(-1ULL << 48), *vec >> 48 };
+	} while (link != stash->tail);
+	return count;
+}
+
+/*
+ * Free everything stashed at once, so that the frees of a delta are
+ * sorted, merged and applied to each bitmap block just once.
+ */
+int retire_frees(struct sb *sb, struct stash *stash)
+{
+	if (!stash->tail)
+		return 0;
+	unsigned count = stash_segs(stash, NULL);
+	if (!count)
+		return 0;
+	struct seg *map = malloc(count * sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+	stash_segs(stash, map);
+	int err = bfree_extents(sb, map, count);
+	free(map);
+	if (err)
+		return err;
+	while (stash->tail != stash->tail->next) {
+		struct page *page = link_entry(stash->tail->next, struct page, private);
 		link_del_next(stash->tail);
 		__free_page(page);
 	}
@@ -43,6 +43,10 @@ static struct inode *tux3_alloc_inode(struct super_block *sb)
 	tuxi->btree = (struct btree){ };
 	tuxi->present = 0;
 	tuxi->xcache = NULL;
+	tuxi->ecache = NULL;
+	tuxi->goal = 0;
+	tuxi->reserved = 0;
+	spin_lock_init(&tuxi->ecache_lock);
 
 	/* uninitialized stuff by alloc_inode() */
 	tuxi->vfs_inode.i_version = 1;
@@ -103,6 +107,7 @@ static void tux3_put_super(struct super_block *sb)
 	tux3_write_super(sb);
 
 	empty_stash(&sbi->defree);
+	free_bsum(sbi);
 	iput(sbi->atable);
 	iput(sbi->bitmap);
 	iput(sbi->volmap);
@@ -163,6 +168,9 @@ static int tux3_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_time_gran = 1;
 
 	mutex_init(&sbi->loglock);
+	mutex_init(&sbi->bucket_lock);
+	for (int i = 0; i < LEAF_LATCHES; i++)
+		mutex_init(&sbi->latch[i]);
 
 	err = -EIO;
 	blocksize = sb_min_blocksize(sb, BLOCK_SIZE);
@@ -156,7 +156,7 @@ static inline void link_del_next(struct link *node)
 /* Tux3 disk format */
 
 #define SB_MAGIC_SIZE 8
-#define SB_MAGIC { 't', 'u', 'x', '3', 0xdd, 0x08, 0x12, 0x12 } /* date of latest incompatible sb format */
+#define SB_MAGIC { 't', 'u', 'x', '3', 0xdd, 0x26, 0x10, 0x18 } /* date of latest incompatible sb format */
 /*
  * disk format revision history
  * !!! always update this for every incompatible change !!!
@@ -164,6 +164,7 @@ static inline void link_del_next(struct link *node)
  * 2008-08-06: Beginning of time
  * 2008-09-06: Actual checking starts
  * 2008-12-12: Atom dictionary size in disksuper instead of atable->i_size
+ * 2026-10-18: Index node count header, 48 bit dedup hashes, orphan attribute
  */
 
 #define MAX_INODES_BITS 48
@@ -179,6 +180,7 @@ static inline void link_del_next(struct link *node)
 #define TUX_VTABLE_INO		2
 #define TUX_INVALID_INO		3	/* FIXME: reserve this */
 #define TUX_ATABLE_INO		10
+#define TUX_ORPHAN_INO		11
 #define TUX_ROOTDIR_INO		13
 
 struct disksuper
@@ -213,6 +215,9 @@ struct btree {
 	struct btree_ops *ops;	/* Generic btree low level operations */
 	struct root root;	/* Cached description of btree root */
 	u16 entries_per_leaf;	/* Used in btree leaf splitting */
+	unsigned gen;		/* Bumped by every index node change */
+	struct cursor *cursor;	/* Path of the last read probe, see keep_cursor */
+	spinlock_t cursor_lock;
 };
 
 /* Define layout of btree root on disk, endian conversion is elsewhere. */
@@ -227,6 +232,14 @@ static inline struct root unpack_root(u64 v)
 	return (struct root){ .depth = v >> 48, .block = v & (-1ULL >> 16), };
 }
 
+/* for tree_chop */
+struct delete_info {
+	tuxkey_t key;
+	block_t blocks, freed;
+	block_t resume;
+	int create;
+};
+
 /* Path cursor for btree traversal */
 
 struct cursor {
@@ -235,9 +248,11 @@ struct cursor {
 #ifdef CURSOR_DEBUG
 #define FREE_BUFFER	((void *)0xdbc06505)
 #define FREE_NEXT	((void *)0xdbc06507)
-	int maxlen;
 #endif
-	int len;
+	int maxlen, len;
+	unsigned gen;		/* btree gen the path was found at, see reprobe */
+	unsigned prefetch;	/* sibling leaves to read ahead in advance() */
+	tuxkey_t prefetch_end;	/* no read ahead of leaves from here on */
 	struct path_level {
 		struct buffer_head *buffer;
 		struct index_entry *next;
@@ -248,6 +263,8 @@ struct stash { struct link *tail; u64 *pos, *top; };
 
 /* Tux3-specific sb is a handle for the entire volume state */
 
+#define LEAF_LATCHES 16
+
 struct sb {
 	struct disksuper super;
 	struct inode *volmap;	/* Volume metadata cache (like blockdev).
@@ -274,13 +291,18 @@ struct sb {
 	struct buffer_head *logbuf; /* Cached log block */
 	unsigned char *logpos, *logtop; /* Where to emit next log entry */
 	struct mutex loglock;	/* serialize log entries (spinlock me) */
+	struct mutex latch[LEAF_LATCHES]; /* btree leaf latches, see latch_leaf */
+	struct mutex bucket_lock; /* serialize dedup bucket and bucket pointer changes */
 	struct stash defree;	/* defer extent frees until affer commit */
+	struct bsum *bsum;	/* free space summary of bitmap blocks */
 	u16 entries_per_bucket; /*Number of entries per bucket */
 	int readcheck; /* Mount point flag for data integrity check */
 #ifdef __KERNEL__
 	struct super_block *vfs_sb; /* Generic kernel superblock */
 #else
 	struct dev *dev;		/* userspace block device */
+	struct hlist_head orphans;	/* inodes left to chop, see reclaim_orphans */
+	struct inode *orphandir;	/* orphans listed on disk, see load_orphans */
 #endif
 };
 
@@ -306,6 +328,11 @@ typedef struct {
 	inum_t inum;		/* Inode number.  Fixme: also in generic inode */
 	unsigned present;	/* Attributes decoded from or to be encoded to inode table */
 	struct xcache *xcache;	/* Extended attribute cache */
+	struct ecache *ecache;	/* Recently mapped extents */
+	spinlock_t ecache_lock;	/* Fills race under the btree read lock */
+	block_t goal;		/* Where file data allocation continues, zero if unset */
+	unsigned reserved;	/* Blocks at goal claimed by writeback, not yet mapped */
+	struct delete_info chop; /* Truncate still to finish, see ORPHAN_ATTR */
 	struct inode vfs_inode;	/* Generic kernel inode */
 } tuxnode_t;
 
@@ -352,6 +379,10 @@ typedef struct inode {
 	inum_t inum;
 	unsigned present;
 	struct xcache *xcache;
+	struct ecache *ecache;
+	spinlock_t ecache_lock;
+	block_t goal;
+	unsigned reserved;
 	struct sb *i_sb;
 	map_t *map;
 	loff_t i_size;
@@ -362,6 +393,8 @@ typedef struct inode {
 	dev_t i_rdev;
 	block_t refbucket;      /* points to block number of current read bucket*/
 	block_t writebucket;    /* points to block number of current write bucket */
+	struct delete_info chop;	/* truncate still to finish, see orphan_add */
+	struct hlist_node orphan;	/* on sb->orphans while chop is pending */
 } tuxnode_t;
 
 struct file {
@@ -485,10 +518,18 @@ static inline void inc_entry_limit(struct entry *entry, int n)
 
 /* extent wrappers */
 
+/* Top version bit: allocated ahead of the data (fallocate), reads as zeros */
+#define EXTENT_UNWRITTEN (1 << 9)
+
+static inline struct diskextent make_extent_version(block_t block, unsigned count, unsigned version)
+{
+	assert(block < (1ULL << 48) && count - 1 < (1 << 6) && version < (1 << 10));
+	return (struct diskextent){ to_be_u64(((u64)version << 54) | ((u64)(count - 1) << 48) | block) };
+}
+
 static inline struct diskextent make_extent(block_t block, unsigned count)
 {
-	assert(block < (1ULL << 48) && count - 1 < (1 << 6));
-	return (struct diskextent){ to_be_u64(((u64)(count - 1) << 48) | block) };
+	return make_extent_version(block, count, 0);
 }
 
 static inline block_t extent_block(struct diskextent extent)
@@ -506,6 +547,11 @@ static inline unsigned extent_version(struct diskextent extent)
 	return from_be_u64(*(be_u64 *)&extent) >> 54;
 }
 
+static inline int extent_unwritten(struct diskextent extent)
+{
+	return !!(extent_version(extent) & EXTENT_UNWRITTEN);
+}
+
 /* dleaf wrappers */
 
 static inline unsigned dleaf_groups(struct dleaf *leaf)
@@ -524,6 +570,16 @@ static inline void inc_dleaf_groups(struct dleaf *leaf, int n)
 }
 
 typedef void vleaf;
+typedef int (btree_scan_t)(struct btree *btree, vleaf *leaf, tuxkey_t key, tuxkey_t limit, void *data);
+
+#define SEG_HOLE	(1 << 0)
+#define SEG_NEW		(1 << 1)
+#define SEG_DUP         (1 << 2)
+#define SEG_UNWRITTEN	(1 << 3)
+#define SEG_DELAYED	(1 << 4)	/* dirty with no block yet, see tuxmap */
+
+/* A run of file blocks as mapped by map_region, or of allocated blocks */
+struct seg { block_t block; unsigned count; unsigned state; };
 
 struct btree_ops {
 	void (*btree_init)(struct btree *btree);
@@ -539,6 +595,7 @@ struct btree_ops {
 	void (*leaf_merge)(struct btree *btree, vleaf *into, vleaf *from);
 	int (*balloc)(struct sb *sb, unsigned blocks, block_t *block);
 	int (*bfree)(struct sb *sb, block_t block, unsigned blocks);
+	int (*bfree_extents)(struct sb *sb, struct seg map[], unsigned count); /* optional */
 };
 
 /*
@@ -571,11 +628,18 @@ static inline fixed32 tuxtime(struct timespec time)
 
 void hexdump(void *data, unsigned size);
 int balloc(struct sb *sb, unsigned blocks, block_t *block);
+int balloc_extents(struct sb *sb, block_t goal, unsigned blocks, struct seg map[], unsigned max_segs);
+int balloc_goal(struct sb *sb, block_t goal, unsigned blocks, block_t *block);
+block_t balloc_find(struct sb *sb, block_t goal, unsigned blocks);
 int bfree(struct sb *sb, block_t start, unsigned blocks);
+int bfree_extents(struct sb *sb, struct seg map[], unsigned count);
+void free_bsum(struct sb *sb);
+block_t group_goal(struct sb *sb, inum_t inum);
 int update_bitmap(struct sb *sb, block_t start, unsigned count, int set);
 
 enum atkind {
-	MIN_ATTR = 6,
+	MIN_ATTR = 5,
+	ORPHAN_ATTR = 5,
 	MODE_OWNER_ATTR = 6,
 	DATA_BTREE_ATTR = 7,
 	CTIME_SIZE_ATTR = 8,
@@ -588,6 +652,7 @@ enum atkind {
 };
 
 enum atbit {
+	ORPHAN_BIT = 1 << ORPHAN_ATTR,
 	MODE_OWNER_BIT = 1 << MODE_OWNER_ATTR,
 	CTIME_SIZE_BIT = 1 << CTIME_SIZE_ATTR,
 	DATA_BTREE_BIT = 1 << DATA_BTREE_ATTR,
@@ -632,20 +697,17 @@ static inline struct ileaf *to_ileaf(vleaf *leaf)
 	return leaf;
 }
 
-/* for tree_chop */
-struct delete_info {
-	tuxkey_t key;
-	block_t blocks, freed;
-	block_t resume;
-	int create;
-};
-
 #ifdef __KERNEL__
 static inline struct timespec gettime(void)
 {
 	return current_kernel_time();
 }
 
+static inline millisecond_t millitime(void)
+{
+	return jiffies_to_msecs(jiffies);
+}
+
 struct tux_iattr {
 	unsigned mode, uid, gid;
 };
@@ -686,14 +748,21 @@ struct buffer_head *cursor_leafbuf(struct cursor *cursor);
 void release_cursor(struct cursor *cursor);
 struct cursor *alloc_cursor(struct btree *btree, int);
 void free_cursor(struct cursor *cursor);
+unsigned bnode_fanout(unsigned blocksize);
+struct mutex *latch_leaf(struct cursor *cursor);
 void level_push(struct cursor *cursor, struct buffer_head *buffer, struct index_entry *next);
 
 void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btree_ops *ops);
 int new_btree(struct btree *btree, struct sb *sb, struct btree_ops *ops);
 struct buffer_head *new_leaf(struct btree *btree);
 int probe(struct btree *btree, tuxkey_t key, struct cursor *cursor);
+int reprobe(struct btree *btree, tuxkey_t key, struct cursor *cursor);
+struct cursor *take_cursor(struct btree *btree, int extra);
+void keep_cursor(struct btree *btree, struct cursor *cursor);
+void drop_cursor(struct btree *btree);
 int advance(struct btree *btree, struct cursor *cursor);
 tuxkey_t next_key(struct cursor *cursor, int depth);
+int btree_scan(struct btree *btree, tuxkey_t start, tuxkey_t end, btree_scan_t *actor, void *data);
 int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline);
 int btree_insert_leaf(struct cursor *cursor, tuxkey_t key, struct buffer_head *leafbuf);
 int btree_leaf_split(struct btree *btree, struct cursor *cursor, tuxkey_t key);
@@ -708,6 +777,7 @@ void init_writebucket(struct inode *inode);
 block_t htree_lookup(struct inode *inode, struct btree *btree, u64 sh, unsigned char *hash);
 block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct hleaf_entry* temp ,unsigned char* hash, int first);
 block_t hash_lookup(struct inode *inode, unsigned char *hash);
+int hash_refcount(struct sb *sb, unsigned char *hash);
 extern struct btree_ops htree_ops;
 
 /* dir.c */
@@ -732,6 +802,7 @@ extern struct btree_ops dtree_ops;
 int dwalk_end(struct dwalk *walk);
 block_t dwalk_block(struct dwalk *walk);
 unsigned dwalk_count(struct dwalk *walk);
+int dwalk_unwritten(struct dwalk *walk);
 tuxkey_t dwalk_index(struct dwalk *walk);
 int dwalk_next(struct dwalk *walk);
 int dwalk_back(struct dwalk *walk);
@@ -742,6 +813,9 @@ void dwalk_chop(struct dwalk *walk);
 int dwalk_add(struct dwalk *walk, tuxkey_t index, struct diskextent extent);
 
 /* filemap.c */
+void invalidate_extents(struct inode *inode);
+void set_data_goal(struct inode *inode, unsigned blocks);
+void put_data_goal(struct inode *inode);
 int tux3_get_block(struct inode *inode, sector_t iblock,
 		   struct buffer_head *bh_result, int create);
 extern const struct address_space_operations tux_aops;
@@ -753,6 +827,7 @@ unsigned encode_asize(unsigned bits);
 void dump_attrs(struct inode *inode);
 void *encode_attrs(struct inode *inode, void *attrs, unsigned size);
 void *decode_attrs(struct inode *inode, void *attrs, unsigned size);
+int has_attr(struct sb *sb, void *attrs, unsigned size, unsigned kind);
 
 /* ileaf.c */
 void *ileaf_lookup(struct btree *btree, inum_t inum, struct ileaf *leaf, unsigned *result);
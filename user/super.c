@@ -38,9 +38,20 @@ int save_sb(struct sb *sb)
 	return diskwrite(sb->dev->fd, super, sizeof(*super), SB_LOC);
 }
 
+#define RECLAIM_SLICE 10 /* milliseconds of orphan chopping per commit */
+
 int sync_super(struct sb *sb)
 {
 	int err;
+	/* go on chopping orphans a while, unmount finishes */
+	int left = reclaim_orphans(sb, millitime() + RECLAIM_SLICE);
+	if (left < 0)
+		return left;
+	if (sb->orphandir) {
+		printf("sync orphan directory\n");
+		if ((err = tuxsync(sb->orphandir)))
+			return err;
+	}
 	printf("sync rootdir\n");
 	if ((err = tuxsync(sb->rootdir)))
 		return err;
@@ -74,6 +85,15 @@ static int clear_other_magic(struct sb *sb)
 	return err;
 }
 
+/* Superblock of a new volume, as mkfs and memory volumes start out */
+void setup_sb(struct sb *sb, block_t volblocks)
+{
+	sb->max_inodes_per_block = 64;
+	sb->entries_per_node = bnode_fanout(sb->blocksize);
+	sb->volblocks = sb->freeblocks = volblocks;
+	sb->super = (struct disksuper){ .magic = SB_MAGIC, .volblocks = to_be_u64(volblocks) };
+}
+
 int make_tux3(struct sb *sb)
 {
 	struct inode *dir = &(struct inode){ INIT_INODE(sb, S_IFDIR | 0755) };
@@ -124,6 +144,11 @@ int make_tux3(struct sb *sb)
 	sb->atomgen = 1; // atom 0 not allowed, means end of atom freelist
 	if (make_inode(sb->atable, TUX_ATABLE_INO))
 		goto eek;
+	trace("create orphan directory");
+	if (!(sb->orphandir = tux_new_inode(dir, &(struct tux_iattr){ .mode = S_IFDIR | 0700 }, 0)))
+		goto eek;
+	if (make_inode(sb->orphandir, TUX_ORPHAN_INO))
+		goto eek;
 	if ((err = sync_super(sb)))
 		goto eek;
 
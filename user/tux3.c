@@ -24,6 +24,105 @@ int fls(uint32_t v)
 	return bit;
 }
 
+struct run { block_t index; struct seg seg; int shared; };
+
+static int run_compare(const void *a, const void *b)
+{
+	block_t x = (*(struct run **)a)->seg.block, y = (*(struct run **)b)->seg.block;
+	return x < y ? -1 : x > y;
+}
+
+/* Whether dedup shares any block of a run, by the refcount of its hash */
+static int run_deduped(struct inode *inode, struct run *run)
+{
+	unsigned char hash[SHA_DIGEST_LENGTH];
+	for (unsigned i = 0; i < run->seg.count; i++) {
+		struct buffer_head *buffer = blockread(mapping(inode), run->index + i);
+		if (!buffer)
+			return -EIO;
+		SHA1(bufdata(buffer), tux_sb(inode->i_sb)->blocksize, hash);
+		brelse(buffer);
+		int refcount = hash_refcount(tux_sb(inode->i_sb), hash);
+		if (refcount < 0 || refcount > 1)
+			return refcount < 0 ? refcount : 1;
+	}
+	return 0;
+}
+
+/*
+ * Print the logical to physical runs of a file.  Dedup shares a block by
+ * mapping it more than once: runs overlapping another run of the file
+ * are shown as shared, and so are runs holding a block whose hash the
+ * dedup table counts more than one reference to.
+ */
+static int show_extents(struct inode *inode)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	block_t index = 0, limit = (inode->i_size + sb->blockmask) >> sb->blockbits;
+	struct run *runs = NULL, **order;
+	unsigned count = 0, mapped = 0, shared = 0;
+	int err = 0;
+	while (index < limit) {
+		struct seg map[64];
+		int segs = tuxmap(inode, index, min(limit - index, (block_t)INT_MAX), map, ARRAY_SIZE(map));
+		if (segs <= 0) {
+			err = segs;
+			break;
+		}
+		struct run *more = realloc(runs, (count + segs) * sizeof(*runs));
+		if (!more) {
+			err = -ENOMEM;
+			break;
+		}
+		runs = more;
+		for (int i = 0; i < segs; index += map[i++].count)
+			runs[count++] = (struct run){ .index = index, .seg = map[i] };
+	}
+	if (err || !(order = malloc(count * sizeof(*order) + 1))) {
+		free(runs);
+		return err ? err : -ENOMEM;
+	}
+	for (unsigned i = 0; i < count; i++)
+		if (!(runs[i].seg.state & (SEG_HOLE | SEG_DELAYED))) {
+			order[mapped++] = runs + i;
+			if (runs[i].seg.state & SEG_UNWRITTEN)
+				continue;
+			if ((err = run_deduped(inode, runs + i)) < 0)
+				break;
+			runs[i].shared = err;
+		}
+	if (err < 0) {
+		free(order);
+		free(runs);
+		return err;
+	}
+	qsort(order, mapped, sizeof(*order), run_compare);
+	for (unsigned i = 1, reach = 0; i < mapped; i++) {
+		struct run *prev = order[reach];
+		if (order[i]->seg.block < prev->seg.block + prev->seg.count)
+			order[i]->shared = prev->shared = 1;
+		if (order[i]->seg.block + order[i]->seg.count > prev->seg.block + prev->seg.count)
+			reach = i;
+	}
+	for (unsigned i = 0; i < count; i++) {
+		struct seg *seg = &runs[i].seg;
+		printf("%Lx/%x", (L)runs[i].index, seg->count);
+		if (seg->state & SEG_HOLE)
+			printf(" hole\n");
+		else if (seg->state & SEG_DELAYED)
+			printf(" delayed\n");
+		else
+			printf(" => %Lx%s%s\n", (L)seg->block,
+			       seg->state & SEG_UNWRITTEN ? " unwritten" : "",
+			       runs[i].shared ? " shared" : "");
+		shared += runs[i].shared;
+	}
+	printf("%u runs, %u mapped, %u shared\n", count, mapped, shared);
+	free(order);
+	free(runs);
+	return 0;
+}
+
 void usage(poptContext optCon, int exitcode, char *error, char *addl) {
 	poptPrintUsage(optCon, stderr, 0);
 	if (error) fprintf(stderr, "%s: %s\n", error, addl);
@@ -36,9 +135,13 @@ int main(int argc, const char *argv[])
 	poptContext popt;
 	char *seekarg = NULL;
 	unsigned blocksize = 0;
+	int mmapped = 0, direct = 0, directmeta = 0;
 	struct poptOption options[] = {
 		{ "seek", 's', POPT_ARG_STRING, &seekarg, 0, "seek offset", "<offset>" },
 		{ "blocksize", 'b', POPT_ARG_INT, &blocksize, 0, "filesystem blocksize", "<size>" },
+		{ "mmap", 'm', POPT_ARG_NONE, &mmapped, 0, "read clean blocks from a mapping of the volume", NULL },
+		{ "direct", 'd', POPT_ARG_NONE, &direct, 0, "O_DIRECT io for file data", NULL },
+		{ "direct-metadata", 'D', POPT_ARG_NONE, &directmeta, 0, "O_DIRECT io for metadata too", NULL },
 		POPT_AUTOHELP
 		{ NULL, 0, 0, NULL, 0 }};
 
@@ -55,7 +158,9 @@ int main(int argc, const char *argv[])
 	/* open volume, create superblock */
 	const char *command = poptGetArg(popt);
 	const char *volname = poptGetArg(popt);
-	fd_t fd = open(volname, O_RDWR, S_IRWXU);
+	fd_t fd = diskopen(volname, O_RDWR, S_IRWXU);
+	if (fd < 0)
+		error("could not open '%s' (%s)", volname, strerror(-fd));
 	u64 volsize = 0;
 	if (fdsize64(fd, &volsize))
 		error("fdsize64 failed for '%s' (%s)", volname, strerror(errno));
@@ -69,14 +174,12 @@ int main(int argc, const char *argv[])
 
 	struct dev *dev = &(struct dev){ fd, .bits = blockbits };
 	init_buffers(dev, 1 << 20, 1);
+	if (mmapped && (errno = -dev_mmap(dev)))
+		goto eek;
+	if ((direct || directmeta) && (errno = -dev_direct(dev, volname, directmeta)))
+		goto eek;
 
-	struct sb *sb = &(struct sb){
-		INIT_SB(dev),
-		.max_inodes_per_block = 64,
-		.entries_per_node = 20,
-		.volblocks = volsize >> dev->bits,
-		.freeblocks = volsize >> dev->bits,
-	};
+	struct sb *sb = &(struct sb){ INIT_SB(dev), };
 	sb->volmap = tux_new_volmap(sb);
 	if (!sb->volmap)
 		goto eek;
@@ -85,7 +188,7 @@ int main(int argc, const char *argv[])
 	if (!strcmp(command, "mkfs") || !strcmp(command, "make")) {
 		if (poptPeekArg(popt))
 			goto usage;
-		sb->super = (struct disksuper){ .magic = SB_MAGIC, .volblocks = to_be_u64(sb->blockbits) };
+		setup_sb(sb, volsize >> dev->bits);
 		printf("make tux3 filesystem on %s (0x%Lx bytes)\n", volname, (L)volsize);
 		if ((errno = -make_tux3(sb)))
 			goto eek;
@@ -106,6 +209,8 @@ int main(int argc, const char *argv[])
 		goto eek;
 	if ((errno = -open_inode(sb->atable)))
 		goto eek;
+	if ((errno = -load_orphans(sb)))
+		goto eek;
 	show_tree_range(&sb->rootdir->btree, 0, -1);
 	show_tree_range(&sb->bitmap->btree, 0, -1);
 	char *filename = (void *)poptGetArg(popt);
@@ -242,27 +347,23 @@ int main(int argc, const char *argv[])
 		free_inode(inode);
 	}
 
-	if (!strcmp(command, "delete")) {
-		printf("---- delete file ----\n");
-		struct buffer_head *buffer;
-		tux_dirent *entry = tux_find_entry(sb->rootdir, filename, strlen(filename), &buffer);
-		if (IS_ERR(entry)) {
-			errno = -PTR_ERR(entry);
+	if (!strcmp(command, "extents")) {
+		printf("---- file extents ----\n");
+		struct inode *inode = tuxopen(sb->rootdir, filename, strlen(filename));
+		if (!inode) {
+			errno = ENOENT;
 			goto eek;
 		}
-		inum_t inum = from_be_u64(entry->inum);
-		struct inode *inode = iget(sb, inum);
-		if ((errno = -open_inode(inode))) {
-			free_inode(inode);
+		if ((errno = -show_extents(inode)))
 			goto eek;
-		}
-		errno = -tree_chop(&inode->btree, &(struct delete_info){ .key = 0 }, -1);
 		free_inode(inode);
-		if (errno)
-			goto eek;
-		if ((errno = -purge_inum(sb, inum)))
+	}
+
+	if (!strcmp(command, "delete")) {
+		printf("---- delete file ----\n");
+		if ((errno = -tuxunlink(sb->rootdir, filename, strlen(filename))))
 			goto eek;
-		if ((errno = -tux_delete_entry(buffer, entry)))
+		if ((errno = -reclaim_orphans(sb, 0)))
 			goto eek;
 		tux_dump_entries(blockread(sb->rootdir->map, 0));
 		if ((errno = -sync_super(sb)))
@@ -284,9 +385,9 @@ int main(int argc, const char *argv[])
 		if (seekarg)
 			seek = strtoull(seekarg, NULL, 0);
 		printf("---- new size %Lu ----\n", (L)seek);
-		inode->i_size = seek;
-		block_t index = (seek + sb->blockmask) >> sb->blockbits;
-		if ((errno = -tree_chop(&inode->btree, &(struct delete_info){ .key = index }, 0)))
+		if ((errno = -tuxtruncate(inode, seek)))
+			goto eek;
+		if ((errno = -reclaim_orphans(sb, 0)))
 			goto eek;
 		tuxsync(inode);
 		if ((errno = -sync_super(sb)))
@@ -155,6 +155,14 @@ void __free_pages(struct page *page, unsigned order)
 }
 #define __free_page(page) __free_pages((page), 0)
 
+/* Kernel sort emulation */
+
+static inline void sort(void *base, size_t num, size_t size,
+	int (*cmp)(const void *, const void *), void (*swap)(void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
 #include "kernel/tux3.h"
 
 static inline struct inode *buffer_inode(struct buffer_head *buffer)
@@ -169,6 +177,13 @@ static inline struct timespec gettime(void)
 	return (struct timespec){ .tv_sec = now.tv_sec, .tv_nsec = now.tv_usec * 1000 };
 }
 
+static inline millisecond_t millitime(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 struct tux_iattr {
 	unsigned mode, uid, gid;
 };
@@ -183,20 +198,29 @@ static inline struct buffer_head *sb_bread(struct sb *sb, block_t block)
 	return blockread(sb->volmap->map, block);
 }
 
+static inline void sb_breadahead(struct sb *sb, block_t block)
+{
+	blockprefetch(sb->volmap->map, block, 1);
+}
+
 #define mark_btree_dirty(x) do {} while (0)
 
 void change_begin(struct sb *sb);
 void change_end(struct sb *sb);
+int orphan_finish(struct inode *inode);
 
 #define INIT_INODE(sb, mode)				\
 	.i_sb = sb,					\
 	.i_mode = mode,					\
 	.i_mutex = __MUTEX_INITIALIZER,			\
+	.ecache_lock = __SPIN_LOCK_UNLOCKED,		\
 	.i_version = 1,					\
 	.i_nlink = 1
 
 #define rapid_open_inode(sb, io, mode)	({		\
-	struct inode *__inode = &(struct inode){	\
+	struct inode *__inode = malloc(sizeof(*__inode)); \
+	assert(__inode);				\
+	*__inode = (struct inode){			\
 		INIT_INODE(sb, mode),			\
 		.btree = {				\
 			.lock = __RWSEM_INITIALIZER,	\
@@ -214,7 +238,9 @@ void change_end(struct sb *sb);
 	.blocksize = 1 << (dev)->bits,			\
 	.blockmask = ((1 << (dev)->bits) - 1),		\
 	.delta_lock = __RWSEM_INITIALIZER,		\
-	.loglock = __MUTEX_INITIALIZER
+	.loglock = __MUTEX_INITIALIZER,			\
+	.bucket_lock = __MUTEX_INITIALIZER,		\
+	.latch = { [0 ... LEAF_LATCHES - 1] = __MUTEX_INITIALIZER }
 
 enum { DT_UNKNOWN, DT_REG, DT_DIR, DT_CHR, DT_BLK, DT_FIFO, DT_SOCK, DT_LNK };
 typedef int (filldir_t)(void *dirent, char *name, unsigned namelen, loff_t offset, unsigned inode, unsigned type);
@@ -33,6 +33,10 @@
  * 1. Create a tux3 fs on testvol using some combination of dd
  *    and ./tux3 make testvol (or use make mkfs)
  * 2. Mount on foo/ like: ./tux3fuse testvol -f foo/ (-f for foreground)
+ *    Add -o mmap to read clean blocks straight from a mapping of the volume.
+ *    Add -o direct for O_DIRECT file data io, -o direct_metadata for all io.
+ *    The volume may also be ram:<size> for a fresh filesystem in memory, or
+ *    hdd:<volume> or nvme:<volume> to model device latency (see diskopen).
  */
 
 //#include <sys/xattr.h>
@@ -56,6 +60,17 @@ static struct sb *sb;
 static struct dev *dev;
 static int readcheck;
 
+static struct tux3_options {
+	int mmap, direct;
+} options;
+
+static struct fuse_opt tux3_opts[] = {
+	{ "mmap", offsetof(struct tux3_options, mmap), 1 },
+	{ "direct", offsetof(struct tux3_options, direct), 1 },
+	{ "direct_metadata", offsetof(struct tux3_options, direct), 2 },
+	FUSE_OPT_END
+};
+
 static struct inode *open_fuse_ino(fuse_ino_t ino)
 {
 	struct inode *inode;
@@ -72,6 +87,39 @@ static struct inode *open_fuse_ino(fuse_ino_t ino)
 	return NULL;
 }
 
+/*
+ * Inodes behind open file handles.  Requests that carry no handle, like
+ * bmap, map through one of these so they see its dirty blocks.
+ */
+static struct inode **handles;
+static unsigned nhandles;
+
+static void add_handle(struct inode *inode)
+{
+	struct inode **grown = realloc(handles, (nhandles + 1) * sizeof(*handles));
+	if (!grown)
+		return; /* only costs bmap its view of dirty blocks */
+	handles = grown;
+	handles[nhandles++] = inode;
+}
+
+static void del_handle(struct inode *inode)
+{
+	for (unsigned i = 0; i < nhandles; i++)
+		if (handles[i] == inode) {
+			handles[i] = handles[--nhandles];
+			return;
+		}
+}
+
+static struct inode *find_handle(fuse_ino_t ino)
+{
+	for (unsigned i = 0; i < nhandles; i++)
+		if (handles[i]->inum == ino)
+			return handles[i];
+	return NULL;
+}
+
 static void tux3_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	trace("tux3_lookup(%Lx, '%s')", (L)parent, name);
@@ -114,6 +162,8 @@ static void tux3_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	if (inode) {
 		fi->flags |= 0666;
 		fi->fh = (uint64_t)(unsigned long)inode;
+		if (inode != sb->rootdir)
+			add_handle(inode);
 		fuse_reply_open(req, fi);
 	} else {
 		fuse_reply_err(req, ENOENT);
@@ -201,6 +251,7 @@ static void tux3_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 		
 
 		fi->fh = (uint64_t)(unsigned long)inode;
+		add_handle(inode);
 		fuse_reply_create(req, &fep, fi);
 	} else {
 		fuse_reply_err(req, ENOMEM);
@@ -389,28 +440,7 @@ static void tux3_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offs
 static void tux3_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	trace("tux3_unlink(%Lx, '%s')", (L)parent, name);
-	struct buffer_head *buffer;
-	tux_dirent *entry = tux_find_entry(sb->rootdir, name, strlen(name), &buffer);
-	if (IS_ERR(entry)) {
-		errno = -PTR_ERR(entry);
-		goto eek;
-	}
-	inum_t inum = from_be_u64(entry->inum);
-	errno = ENOMEM;
-	struct inode *inode = iget(sb, inum);
-	if (!inode)
-		goto eek;
-	if ((errno = -open_inode(inode))) {
-		free_inode(inode);
-		goto eek;
-	}
-	errno = -tree_chop(&inode->btree, &(struct delete_info){ .key = 0 }, -1);
-	free_inode(inode);
-	if (errno)
-		goto eek;
-	if ((errno = -purge_inum(sb, inum)))
-		goto eek;
-	if ((errno = -tux_delete_entry(buffer, entry)))
+	if ((errno = -tuxunlink(sb->rootdir, name, strlen(name))))
 		goto eek;
 	if ((errno = -sync_super(sb)))
  		goto eek;
@@ -426,7 +456,7 @@ static void tux3_init(void *data, struct fuse_conn_info *conn)
 {
 	const char *volname = data;
 	int fd;
-	if ((fd = open(volname, O_RDWR, S_IRWXU)) < 0)
+	if ((fd = diskopen(volname, O_RDWR, S_IRWXU)) < 0)
 		error("volume %s not found", volname);
 
 	volsize = 0;
@@ -435,11 +465,23 @@ static void tux3_init(void *data, struct fuse_conn_info *conn)
 	dev = malloc(sizeof(*dev));
 	*dev = (struct dev){ .fd = fd, .bits = 12 };
 	init_buffers(dev, 1<<20, 1);
+	if (options.mmap && (errno = -dev_mmap(dev)))
+		goto eek;
+	if (options.direct && (errno = -dev_direct(dev, volname, options.direct == 2)))
+		goto eek;
 	sb = malloc(sizeof(*sb));
 	*sb = (struct sb){ INIT_SB(dev), };
 	sb->volmap = tux_new_volmap(sb);
 	if (!sb->volmap)
 		goto eek;
+	if (diskmemory(volname)) {
+		/* a memory volume starts out empty, make it mountable */
+		setup_sb(sb, volsize >> dev->bits);
+		if ((errno = -make_tux3(sb)))
+			goto eek;
+		sb->readcheck = readcheck;
+		return;
+	}
 	if ((errno = -load_sb(sb)))
 		goto eek;
 	if (!(sb->bitmap = iget(sb, TUX_BITMAP_INO)))
@@ -454,6 +496,8 @@ static void tux3_init(void *data, struct fuse_conn_info *conn)
 		goto eek;
 	if ((errno = -open_inode(sb->atable)))
 		goto eek;
+	if ((errno = -load_orphans(sb)))
+		goto eek;
 	sb->readcheck = readcheck;
 	return;
 nomem:
@@ -565,10 +609,18 @@ static void tux3_rename(fuse_req_t req, fuse_ino_t parent,
 	fuse_reply_err(req, ENOSYS);
 }
 
+/* Free blocks are counted as they change, no bitmap scan here */
 static void tux3_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	warn("not implemented");
-	fuse_reply_err(req, ENOSYS);
+	struct statvfs buf = {
+		.f_bsize = sb->blocksize,
+		.f_frsize = sb->blocksize,
+		.f_blocks = sb->volblocks,
+		.f_bfree = sb->freeblocks,
+		.f_bavail = sb->freeblocks,
+		.f_namemax = TUX_NAME_LEN,
+	};
+	fuse_reply_statfs(req, &buf);
 }
 
 static void tux3_access(fuse_req_t req, fuse_ino_t ino, int mask)
@@ -595,6 +647,7 @@ static void tux3_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
 	trace("release (%Lx)", (L)ino);
 	if (ino != FUSE_ROOT_ID) {
 		struct inode *inode = (struct inode *)(unsigned long)fi->fh;
+		del_handle(inode);
 		tuxclose(inode);
 		if ((errno = -sync_super(sb))) {
 			fuse_reply_err(req, errno);
@@ -705,8 +758,41 @@ static void tux3_setlk(fuse_req_t req, fuse_ino_t ino,
 
 static void tux3_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize, uint64_t idx)
 {
-	warn("not implemented");
-	fuse_reply_err(req, ENOSYS);
+	trace("tux3_bmap(%Lx, %Lx)", (L)ino, (L)idx);
+	struct inode *inode = find_handle(ino), *opened = NULL;
+	struct seg seg;
+	int segs;
+	if (!inode && !(inode = opened = open_fuse_ino(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (blocksize != sb->blocksize)
+		fuse_reply_err(req, EINVAL);
+	else if ((segs = tuxmap(inode, idx, 1, &seg, 1)) < 0)
+		fuse_reply_err(req, -segs);
+	else {
+		/* zero means unmapped */
+		fuse_reply_bmap(req, segs && !(seg.state & (SEG_HOLE | SEG_UNWRITTEN | SEG_DELAYED)) ? seg.block : 0);
+	}
+	if (opened && opened != sb->rootdir)
+		free_inode(opened);
+}
+
+static void tux3_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+	off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	trace("tux3_fallocate(%Lx, %Lx/%Lx)", (L)ino, (L)offset, (L)length);
+	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
+	if ((errno = -tuxfallocate(inode, offset, length, mode)))
+		goto eek;
+	tuxsync(inode);
+	if ((errno = -sync_super(sb)))
+		goto eek;
+	fuse_reply_err(req, 0);
+	return;
+eek:
+	warn("Eek! %s", strerror(errno));
+	fuse_reply_err(req, errno);
 }
 
 static struct fuse_lowlevel_ops tux3_ops = {
@@ -744,6 +830,7 @@ static struct fuse_lowlevel_ops tux3_ops = {
 	.getlk = tux3_getlk,
 	.setlk = tux3_setlk,
 	.bmap = tux3_bmap,
+	.fallocate = tux3_fallocate,
 };
 
 int main(int argc, char *argv[])
@@ -755,7 +842,9 @@ int main(int argc, char *argv[])
 	int err = -1;
 	if (argc < 3)
 		error("usage: %s <volname> <mountpoint>", argv[0]);
-	
+	if (fuse_opt_parse(&args, &options, tux3_opts, NULL) == -1)
+		error("bad options");
+
 	if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) != -1)
 	{
 		struct fuse_chan *fc = fuse_mount(mountpoint, &args);
@@ -775,6 +864,7 @@ int main(int argc, char *argv[])
 						readcheck = 1;
 					fuse_daemonize(foreground);					
 					err = fuse_session_loop(fs);
+					reclaim_orphans(sb, 0);
 					sync_super(sb);
 					fuse_remove_signal_handlers(fs);
 					fuse_session_remove_chan(fc);
@@ -143,7 +143,7 @@ static void draw_bnode(struct graph_info *gi, int depth, int level,
 		fprintf(gi->f,
 			" %c <f%u> key %llu, block %lld",
 			n ? '|' : '{', n,
-			(L)from_be_u64(index[n].key), (L)from_be_u64(index[n].block));
+			(L)index_key(index + n), (L)index_block(index + n));
 	}
 	fprintf(gi->f,
 		" }}\"\n"
@@ -155,7 +155,7 @@ static void draw_bnode(struct graph_info *gi, int depth, int level,
 			fprintf(gi->f,
 				"%s_bnode_%llu:f%u -> %s_%llu:%s0;\n",
 				gi->bname, (L)blocknr, n,
-				gi->lname, (L)from_be_u64(index[n].block),
+				gi->lname, (L)index_block(index + n),
 				gi->lname);
 		}
 	} else {
@@ -163,7 +163,7 @@ static void draw_bnode(struct graph_info *gi, int depth, int level,
 			fprintf(gi->f,
 				"%s_bnode_%llu:f%u -> %s_bnode_%llu:bnode0;\n",
 				gi->bname, (L)blocknr, n,
-				gi->bname, (L)from_be_u64(index[n].block));
+				gi->bname, (L)index_block(index + n));
 		}
 	}
 }
@@ -187,7 +187,7 @@ static int draw_advance(struct graph_info *gi, struct btree *btree,
 		level--;
 	} while (level_finished(cursor, level));
 	while (1) {
-		buffer = sb_bread(vfs_sb(btree->sb), from_be_u64(cursor->path[level].next->block));
+		buffer = sb_bread(vfs_sb(btree->sb), index_block(cursor->path[level].next));
 		if (!buffer)
 			goto eek;
 		cursor->path[level].next++;
@@ -724,7 +724,9 @@ int main(int argc, const char *argv[])
 	if (!volname)
 		goto usage;
 
-	fd_t fd = open(volname, O_RDWR, S_IRWXU);
+	fd_t fd = diskopen(volname, O_RDWR, S_IRWXU);
+	if (fd < 0)
+		error("could not open '%s' (%s)", volname, strerror(-fd));
 	u64 volsize = 0;
 	if (fdsize64(fd, &volsize))
 		error("fdsize64 failed for '%s' (%s)",
@@ -9,6 +9,7 @@
  */
 
 #include "tux3.h"
+#include "diskio.h"
 
 #ifndef trace
 #define trace trace_on
@@ -27,7 +28,10 @@ void change_end(struct sb *sb) { }
 int main(int argc, char *argv[])
 {
 	unsigned abits = DATA_BTREE_BIT|CTIME_SIZE_BIT|MODE_OWNER_BIT|LINK_COUNT_BIT|MTIME_BIT;
-	struct dev *dev = &(struct dev){ .bits = 8, .fd = open(argv[1], O_CREAT|O_RDWR, S_IRWXU) };
+	fd_t fd = diskopen(argv[1], O_CREAT|O_RDWR, S_IRWXU);
+	if (fd < 0)
+		error("could not open '%s' (%s)", argv[1], strerror(-fd));
+	struct dev *dev = &(struct dev){ .bits = 8, .fd = fd };
 	ftruncate(dev->fd, 1 << 24);
 	init_buffers(dev, 1 << 20, 0);
 	struct sb *sb = &(struct sb){